@@ -1,4 +1,4 @@
 #!/bin/bash
 set -ex
-g++ -std=c++11 -Wall -Werror tests/*.cpp src/minijson.cpp -o tests.out
+g++ -std=c++11 -Wall -Werror tests/*.cpp src/minijson.cpp src/nonceindex.cpp src/timerwheel.cpp src/persistqueue.cpp src/replayfilter.cpp src/workerpool.cpp src/topictrie.cpp src/ubsub.cpp src/sha256.cpp src/salsa20.cpp -pthread -o tests.out
 ./tests.out
\ No newline at end of file
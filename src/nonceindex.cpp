@@ -0,0 +1,123 @@
+#include <stdlib.h>
+#include "nonceindex.h"
+
+NonceIndex::NonceIndex() {
+  this->table = NULL;
+  this->mask = 0;
+  this->count = 0;
+  this->maxItems = 0;
+}
+
+NonceIndex::~NonceIndex() {
+  free(this->table);
+}
+
+bool NonceIndex::init(int maxItems) {
+  free(this->table);
+  this->table = NULL;
+  this->mask = 0;
+  this->count = 0;
+  this->maxItems = 0;
+
+  if (maxItems <= 0)
+    return true;
+
+  // Keep load factor <= 0.5 so probe runs stay short
+  uint32_t size = 2;
+  while (size < (uint32_t)maxItems * 2)
+    size <<= 1;
+
+  this->table = (Entry*)malloc(sizeof(Entry) * size);
+  if (this->table == NULL)
+    return false;
+
+  this->mask = size - 1;
+  this->maxItems = maxItems;
+  this->clear();
+  return true;
+}
+
+int NonceIndex::get(uint64_t key) const {
+  if (this->table == NULL)
+    return -1;
+
+  for (uint32_t i = this->slotFor(key); ; i = (i + 1) & this->mask) {
+    const Entry& e = this->table[i];
+    if (e.value < 0)
+      return -1;
+    if (e.key == key)
+      return e.value;
+  }
+}
+
+bool NonceIndex::put(uint64_t key, int value) {
+  if (this->table == NULL || value < 0)
+    return false;
+
+  uint32_t i = this->slotFor(key);
+  for (; this->table[i].value >= 0; i = (i + 1) & this->mask) {
+    if (this->table[i].key == key) {
+      this->table[i].value = value;
+      return true;
+    }
+  }
+
+  if (this->count >= this->maxItems)
+    return false;
+
+  this->table[i].key = key;
+  this->table[i].value = value;
+  this->count++;
+  return true;
+}
+
+bool NonceIndex::remove(uint64_t key) {
+  if (this->table == NULL)
+    return false;
+
+  uint32_t i = this->slotFor(key);
+  for (; ; i = (i + 1) & this->mask) {
+    if (this->table[i].value < 0)
+      return false;
+    if (this->table[i].key == key)
+      break;
+  }
+
+  // Backward-shift: pull later entries of the run into the hole if their
+  // home slot is at or before it, so lookups stay tombstone-free
+  uint32_t hole = i;
+  for (uint32_t j = (i + 1) & this->mask; this->table[j].value >= 0; j = (j + 1) & this->mask) {
+    uint32_t home = this->slotFor(this->table[j].key);
+    if (((j - home) & this->mask) >= ((j - hole) & this->mask)) {
+      this->table[hole] = this->table[j];
+      hole = j;
+    }
+  }
+  this->table[hole].value = -1;
+  this->count--;
+  return true;
+}
+
+void NonceIndex::clear() {
+  for (uint32_t i=0; this->table != NULL && i <= this->mask; ++i)
+    this->table[i].value = -1;
+  this->count = 0;
+}
+
+int NonceIndex::size() const {
+  return this->count;
+}
+
+int NonceIndex::capacity() const {
+  return this->maxItems;
+}
+
+uint32_t NonceIndex::slotFor(uint64_t key) const {
+  // splitmix64 finalizer; keys may be sequential so they need mixing
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebULL;
+  key ^= key >> 31;
+  return (uint32_t)key & this->mask;
+}
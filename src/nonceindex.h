@@ -0,0 +1,51 @@
+#include <stdint.h>
+
+#ifndef ubsub_nonceindex_h
+#define ubsub_nonceindex_h
+
+/**
+Fixed-size hash index from a 64 bit key (nonce, funcId, etc) to a small integer,
+typically the position of an item in a preallocated table.
+
+Open addressing with linear probing; deletes shift following entries back so
+lookups never have to step over tombstones. The table is allocated once by init()
+and never grows, so operations don't touch the heap.
+**/
+
+class NonceIndex {
+private:
+  struct Entry {
+    uint64_t key;
+    int32_t value; // < 0 when slot is empty
+  };
+
+  Entry* table;
+  uint32_t mask;
+  int count;
+  int maxItems;
+
+public:
+  NonceIndex();
+  ~NonceIndex();
+
+  // Allocates room for maxItems entries. Returns false if allocation failed
+  bool init(int maxItems);
+
+  // Returns the value for key, or -1 if not present
+  int get(uint64_t key) const;
+
+  // Inserts or replaces key. Values must be >= 0. Returns false if the index is full
+  bool put(uint64_t key, int value);
+
+  // Returns false if key wasn't present
+  bool remove(uint64_t key);
+
+  void clear();
+  int size() const;
+  int capacity() const;
+
+private:
+  uint32_t slotFor(uint64_t key) const;
+};
+
+#endif
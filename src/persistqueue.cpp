@@ -0,0 +1,347 @@
+#if !(ARDUINO || PARTICLE)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "persistqueue.h"
+
+static uint32_t recordSize(int len) {
+  return (16 + len + 7) & ~7u; // Keep headers 8-byte aligned
+}
+
+PersistentQueue::PersistentQueue() {
+  this->dir = NULL;
+  this->segments = NULL;
+  this->segmentCount = 0;
+  this->maxSegments = 0;
+  this->segmentBytes = 0;
+  this->firstNewSeq = 0;
+  this->dirty = false;
+}
+
+PersistentQueue::~PersistentQueue() {
+  this->close();
+}
+
+bool PersistentQueue::open(const char *dir, uint32_t segmentBytes, int maxSegments) {
+  this->close();
+  if (dir == NULL || maxSegments <= 0 || segmentBytes < recordSize(0) * 2)
+    return false;
+
+  if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+    return false;
+
+  this->segments = (Segment*)malloc(sizeof(Segment) * maxSegments);
+  this->dir = strdup(dir);
+  if (this->segments == NULL || this->dir == NULL) {
+    this->close();
+    return false;
+  }
+  this->maxSegments = maxSegments;
+  this->segmentBytes = segmentBytes;
+
+  DIR* d = opendir(dir);
+  if (d == NULL) {
+    this->close();
+    return false;
+  }
+
+  // Collect existing segments, sorted by seq
+  struct dirent* ent;
+  while ((ent = readdir(d)) != NULL && this->segmentCount < maxSegments) {
+    unsigned int seq;
+    char suffix[8];
+    if (strlen(ent->d_name) != 12 || sscanf(ent->d_name, "%8x.%3s", &seq, suffix) != 2 || strcmp(suffix, "seg") != 0)
+      continue;
+
+    int i = this->segmentCount++;
+    while (i > 0 && this->segments[i-1].seq > seq) {
+      this->segments[i] = this->segments[i-1];
+      --i;
+    }
+    this->segments[i].seq = seq;
+  }
+  closedir(d);
+
+  // Map them and find where each one ends
+  int i = 0;
+  while (i < this->segmentCount) {
+    Segment &seg = this->segments[i];
+    this->firstNewSeq = seg.seq + 1;
+    if (!this->mapSegment(seg, false)) {
+      memmove(&this->segments[i], &this->segments[i+1], sizeof(Segment) * (this->segmentCount - i - 1));
+      this->segmentCount--;
+      continue;
+    }
+
+    while (seg.end + recordSize(0) <= this->segmentBytes) {
+      const Record* rec = (const Record*)(seg.base + seg.end);
+      if (rec->magic != PERSISTQUEUE_MAGIC || rec->len == 0 || seg.end + recordSize(rec->len) > this->segmentBytes)
+        break;
+      if (!rec->acked)
+        seg.live++;
+      seg.end += recordSize(rec->len);
+    }
+
+    if (seg.live == 0) {
+      this->dropSegment(i);
+      continue;
+    }
+    ++i;
+  }
+
+  return true;
+}
+
+void PersistentQueue::close() {
+  if (this->segments != NULL) {
+    this->sync();
+    for (int i=0; i<this->segmentCount; ++i) {
+      munmap(this->segments[i].base, this->segmentBytes);
+      ::close(this->segments[i].fd);
+    }
+  }
+  free(this->segments);
+  free(this->dir);
+  this->segments = NULL;
+  this->dir = NULL;
+  this->segmentCount = 0;
+  this->maxSegments = 0;
+  this->firstNewSeq = 0;
+  this->dirty = false;
+}
+
+bool PersistentQueue::isOpen() const {
+  return this->segments != NULL;
+}
+
+int64_t PersistentQueue::append(const uint64_t &nonce, const uint8_t *buf, int len, uint8_t tag) {
+  if (!this->isOpen() || len <= 0 || len > 0xFFFF || recordSize(len) > this->segmentBytes)
+    return -1;
+
+  // Only segments created since open() are appended to
+  Segment* seg = this->segmentCount > 0 ? &this->segments[this->segmentCount-1] : NULL;
+  if (seg == NULL || seg->seq < this->firstNewSeq || seg->end + recordSize(len) > this->segmentBytes) {
+    if (seg != NULL && seg->seq >= this->firstNewSeq && seg->live == 0) {
+      this->dropSegment(this->segmentCount-1); // Full, and nothing left in it to keep
+    }
+    if (this->segmentCount >= this->maxSegments)
+      return -1;
+
+    Segment &next = this->segments[this->segmentCount];
+    next.seq = this->segmentCount > 0 && this->segments[this->segmentCount-1].seq >= this->firstNewSeq ? this->segments[this->segmentCount-1].seq + 1 : this->firstNewSeq;
+    if (!this->mapSegment(next, true))
+      return -1;
+    this->segmentCount++;
+    seg = &next;
+  }
+
+  const uint32_t offset = seg->end;
+  Record* rec = (Record*)(seg->base + offset);
+  rec->len = (uint16_t)len;
+  rec->acked = 0;
+  rec->tag = tag;
+  rec->nonce = nonce;
+  memcpy(seg->base + offset + sizeof(Record), buf, len);
+  __sync_synchronize();
+  rec->magic = PERSISTQUEUE_MAGIC;
+
+  seg->end += recordSize(len);
+  seg->live++;
+  this->markDirty(*seg, offset, seg->end);
+
+  return (int64_t)seg->seq << 32 | offset;
+}
+
+void PersistentQueue::ack(int64_t ref) {
+  if (ref < 0)
+    return;
+  const int idx = this->findSegment((uint32_t)(ref >> 32));
+  if (idx < 0)
+    return;
+
+  Segment &seg = this->segments[idx];
+  const uint32_t offset = (uint32_t)ref;
+  if (offset >= seg.end)
+    return;
+  Record* rec = (Record*)(seg.base + offset);
+  if (rec->magic != PERSISTQUEUE_MAGIC || rec->acked)
+    return;
+
+  rec->acked = 1;
+  seg.live--;
+  this->markDirty(seg, offset, offset + sizeof(Record));
+
+  // Reclaim fully acked segments, except the one still being appended to
+  if (seg.live == 0 && (idx != this->segmentCount-1 || seg.seq < this->firstNewSeq))
+    this->dropSegment(idx);
+}
+
+void PersistentQueue::sync() {
+  if (!this->dirty)
+    return;
+
+  const uint32_t page = (uint32_t)sysconf(_SC_PAGESIZE);
+  for (int i=0; i<this->segmentCount; ++i) {
+    Segment &seg = this->segments[i];
+    if (seg.dirtyLo >= seg.dirtyHi)
+      continue;
+    const uint32_t lo = seg.dirtyLo - seg.dirtyLo % page;
+    msync(seg.base + lo, seg.dirtyHi - lo, MS_SYNC);
+    seg.dirtyLo = this->segmentBytes;
+    seg.dirtyHi = 0;
+  }
+  this->dirty = false;
+}
+
+bool PersistentQueue::needsSync() const {
+  return this->dirty;
+}
+
+int64_t PersistentQueue::nextRecovered(int64_t ref) const {
+  uint32_t seq = 0;
+  uint32_t offset = 0;
+  if (ref >= 0) {
+    seq = (uint32_t)(ref >> 32);
+    offset = (uint32_t)ref;
+    const Record* rec = NULL;
+    const int idx = this->findSegment(seq);
+    if (idx >= 0 && offset < this->segments[idx].end)
+      rec = (const Record*)(this->segments[idx].base + offset);
+    offset += rec != NULL ? recordSize(rec->len) : recordSize(0);
+  }
+
+  for (int i=0; i<this->segmentCount && this->segments[i].seq < this->firstNewSeq; ++i) {
+    const Segment &seg = this->segments[i];
+    if (seg.seq < seq)
+      continue;
+    if (seg.seq > seq)
+      offset = 0;
+
+    while (offset < seg.end) {
+      const Record* rec = (const Record*)(seg.base + offset);
+      if (!rec->acked)
+        return (int64_t)seg.seq << 32 | offset;
+      offset += recordSize(rec->len);
+    }
+  }
+  return -1;
+}
+
+const uint8_t* PersistentQueue::get(int64_t ref, int *len, uint64_t *nonce, uint8_t *tag) const {
+  if (ref < 0)
+    return NULL;
+  const int idx = this->findSegment((uint32_t)(ref >> 32));
+  if (idx < 0)
+    return NULL;
+
+  const Segment &seg = this->segments[idx];
+  const uint32_t offset = (uint32_t)ref;
+  if (offset >= seg.end)
+    return NULL;
+  const Record* rec = (const Record*)(seg.base + offset);
+  if (rec->magic != PERSISTQUEUE_MAGIC)
+    return NULL;
+
+  if (len != NULL)
+    *len = rec->len;
+  if (nonce != NULL)
+    *nonce = rec->nonce;
+  if (tag != NULL)
+    *tag = rec->tag;
+  return seg.base + offset + sizeof(Record);
+}
+
+int PersistentQueue::size() const {
+  int count = 0;
+  for (int i=0; i<this->segmentCount; ++i)
+    count += this->segments[i].live;
+  return count;
+}
+
+int PersistentQueue::findSegment(uint32_t seq) const {
+  int lo = 0;
+  int hi = this->segmentCount - 1;
+  while (lo <= hi) {
+    const int mid = (lo + hi) / 2;
+    if (this->segments[mid].seq == seq)
+      return mid;
+    if (this->segments[mid].seq < seq)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+  return -1;
+}
+
+bool PersistentQueue::mapSegment(Segment &seg, bool create) {
+  char path[512];
+  this->segmentPath(path, sizeof(path), seg.seq);
+
+  seg.fd = ::open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0600);
+  if (seg.fd < 0)
+    return false;
+
+  struct stat st;
+  if (create ? ftruncate(seg.fd, this->segmentBytes) != 0 : (fstat(seg.fd, &st) != 0 || (uint32_t)st.st_size != this->segmentBytes)) {
+    ::close(seg.fd);
+    return false;
+  }
+
+  void* base = mmap(NULL, this->segmentBytes, PROT_READ | PROT_WRITE, MAP_SHARED, seg.fd, 0);
+  if (base == MAP_FAILED) {
+    ::close(seg.fd);
+    if (create)
+      unlink(path);
+    return false;
+  }
+
+  if (create) {
+    // Make the new file's directory entry durable, once per segment rather than per append
+    int dfd = ::open(this->dir, O_RDONLY);
+    if (dfd >= 0) {
+      fsync(dfd);
+      ::close(dfd);
+    }
+  }
+
+  seg.base = (uint8_t*)base;
+  seg.end = 0;
+  seg.live = 0;
+  seg.dirtyLo = this->segmentBytes;
+  seg.dirtyHi = 0;
+  return true;
+}
+
+void PersistentQueue::dropSegment(int idx) {
+  Segment &seg = this->segments[idx];
+  char path[512];
+  this->segmentPath(path, sizeof(path), seg.seq);
+
+  munmap(seg.base, this->segmentBytes);
+  ::close(seg.fd);
+  unlink(path);
+
+  memmove(&this->segments[idx], &this->segments[idx+1], sizeof(Segment) * (this->segmentCount - idx - 1));
+  this->segmentCount--;
+}
+
+void PersistentQueue::segmentPath(char *buf, int bufLen, uint32_t seq) const {
+  snprintf(buf, bufLen, "%s/%08x.seg", this->dir, seq);
+}
+
+void PersistentQueue::markDirty(Segment &seg, uint32_t lo, uint32_t hi) {
+  if (lo < seg.dirtyLo)
+    seg.dirtyLo = lo;
+  if (hi > seg.dirtyHi)
+    seg.dirtyHi = hi;
+  this->dirty = true;
+}
+
+#endif
@@ -0,0 +1,93 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef ubsub_persistqueue_h
+#define ubsub_persistqueue_h
+
+#if !(ARDUINO || PARTICLE)
+
+/**
+Crash-safe log of outbound packets (unix only).
+
+Packets are appended to fixed-size, memory-mapped segment files in a directory,
+so an append is a memcpy into the mapping. Each record carries an ack marker
+that is set in place once the router has acknowledged the packet. sync() flushes
+dirty ranges to disk and is meant to be called in batches, not per append.
+A segment whose records have all been acked is deleted.
+
+Records that were already on disk when the log was opened are "recovered" and
+can be walked with nextRecovered() to replay them.
+
+Records are referenced by a 64 bit ref: segment sequence << 32 | offset.
+**/
+
+#define PERSISTQUEUE_MAGIC 0x51504255 // "UBPQ", written last so torn records are ignored
+
+class PersistentQueue {
+private:
+  struct Record {
+    uint32_t magic;
+    uint16_t len;
+    uint8_t acked;
+    uint8_t tag;
+    uint64_t nonce;
+  };
+
+  struct Segment {
+    uint32_t seq;
+    int fd;
+    uint8_t* base;
+    uint32_t end; // Append offset
+    uint32_t live; // Records not yet acked
+    uint32_t dirtyLo;
+    uint32_t dirtyHi; // Dirty byte range since the last sync, empty when lo >= hi
+  };
+
+  char* dir;
+  Segment* segments; // Ordered by seq
+  int segmentCount;
+  int maxSegments;
+  uint32_t segmentBytes;
+  uint32_t firstNewSeq; // Segments below this were recovered at open()
+  bool dirty;
+
+public:
+  PersistentQueue();
+  ~PersistentQueue();
+
+  // Opens (creating if needed) the log in dir, and maps any existing segments.
+  // Segments are segmentBytes each, and at most maxSegments exist at once
+  bool open(const char *dir, uint32_t segmentBytes, int maxSegments);
+  void close();
+  bool isOpen() const;
+
+  // Appends a packet, with a caller-defined tag byte. Returns its ref, or -1 if the log is full or unwritable
+  int64_t append(const uint64_t &nonce, const uint8_t *buf, int len, uint8_t tag = 0);
+
+  // Marks a record as acked. Deletes its segment once every record in it is acked
+  void ack(int64_t ref);
+
+  // Flushes changes since the last sync to disk (blocking). No-op if nothing changed
+  void sync();
+  bool needsSync() const;
+
+  // Next un-acked recovered record after ref (-1 for the first), or -1 when there are no more
+  int64_t nextRecovered(int64_t ref) const;
+
+  // Packet of a record, or NULL if ref is no longer valid
+  const uint8_t* get(int64_t ref, int *len, uint64_t *nonce, uint8_t *tag = NULL) const;
+
+  // Number of un-acked records
+  int size() const;
+
+private:
+  int findSegment(uint32_t seq) const;
+  bool mapSegment(Segment &seg, bool create);
+  void dropSegment(int idx);
+  void segmentPath(char *buf, int bufLen, uint32_t seq) const;
+  void markDirty(Segment &seg, uint32_t lo, uint32_t hi);
+};
+
+#endif
+
+#endif
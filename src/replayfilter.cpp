@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <string.h>
+#include "replayfilter.h"
+
+ReplayFilter::ReplayFilter() {
+  this->storage = NULL;
+  this->mask = 0;
+  this->maxItems = 0;
+  this->sliceSeconds = 1;
+  this->windowSeconds = 0;
+  for (int i=0; i<REPLAYFILTER_BUCKETS; ++i)
+    this->buckets[i].table = NULL;
+  this->clear();
+}
+
+ReplayFilter::~ReplayFilter() {
+  free(this->storage);
+}
+
+bool ReplayFilter::init(uint32_t windowSeconds, uint32_t maxRate) {
+  free(this->storage);
+  this->storage = NULL;
+  this->mask = 0;
+  this->maxItems = 0;
+
+  // Every nonce that can still be live falls into one of the buckets' slices
+  this->windowSeconds = windowSeconds;
+  this->sliceSeconds = (windowSeconds + REPLAYFILTER_BUCKETS - 2) / (REPLAYFILTER_BUCKETS - 1);
+  if (this->sliceSeconds == 0)
+    this->sliceSeconds = 1;
+
+  // Keep load factor <= 0.5 so probe runs stay short
+  uint32_t maxItems = maxRate * this->sliceSeconds;
+  if (maxItems == 0)
+    maxItems = 1;
+  uint32_t size = 2;
+  while (size < maxItems * 2)
+    size <<= 1;
+
+  this->storage = (uint64_t*)malloc(sizeof(uint64_t) * size * REPLAYFILTER_BUCKETS);
+  if (this->storage == NULL)
+    return false;
+
+  this->mask = size - 1;
+  this->maxItems = maxItems;
+  for (int i=0; i<REPLAYFILTER_BUCKETS; ++i)
+    this->buckets[i].table = this->storage + (size_t)size * i;
+  this->clear();
+  return true;
+}
+
+bool ReplayFilter::contains(uint64_t nonce, uint64_t now) const {
+  const uint64_t currentSlice = now / this->sliceSeconds;
+  for (int i=0; i<REPLAYFILTER_BUCKETS; ++i) {
+    const Bucket &bucket = this->buckets[i];
+    if (bucket.slice >= currentSlice && this->probe(bucket, nonce))
+      return true;
+  }
+  return false;
+}
+
+bool ReplayFilter::insert(uint64_t nonce, uint64_t expires, uint64_t now) {
+  if (this->storage == NULL)
+    return false;
+  if (expires < now)
+    return true; // Already can't be replayed
+  if (expires > now + this->windowSeconds)
+    expires = now + this->windowSeconds;
+
+  const uint64_t slice = expires / this->sliceSeconds;
+  Bucket &bucket = this->buckets[slice % REPLAYFILTER_BUCKETS];
+  if (bucket.slice != slice) {
+    // Whatever the bucket held has expired by now
+    memset(bucket.table, 0, sizeof(uint64_t) * (this->mask + 1));
+    bucket.slice = slice;
+    bucket.count = 0;
+    bucket.hasZero = false;
+  }
+
+  if (nonce == 0) {
+    bucket.hasZero = true;
+    return true;
+  }
+
+  uint32_t i = this->slotFor(nonce);
+  for (; bucket.table[i] != 0; i = (i + 1) & this->mask) {
+    if (bucket.table[i] == nonce)
+      return true;
+  }
+
+  if (bucket.count >= this->maxItems)
+    return false;
+
+  bucket.table[i] = nonce;
+  bucket.count++;
+  return true;
+}
+
+void ReplayFilter::clear() {
+  for (int i=0; i<REPLAYFILTER_BUCKETS; ++i) {
+    Bucket &bucket = this->buckets[i];
+    if (bucket.table != NULL)
+      memset(bucket.table, 0, sizeof(uint64_t) * (this->mask + 1));
+    bucket.slice = 0;
+    bucket.count = 0;
+    bucket.hasZero = false;
+  }
+}
+
+uint32_t ReplayFilter::slotFor(uint64_t nonce) const {
+  // splitmix64 finalizer; nonces may be sequential so they need mixing
+  uint64_t h = nonce;
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return (uint32_t)h & this->mask;
+}
+
+bool ReplayFilter::probe(const Bucket &bucket, uint64_t nonce) const {
+  if (nonce == 0)
+    return bucket.hasZero;
+  if (bucket.table == NULL || bucket.count == 0)
+    return false;
+
+  for (uint32_t i = this->slotFor(nonce); bucket.table[i] != 0; i = (i + 1) & this->mask) {
+    if (bucket.table[i] == nonce)
+      return true;
+  }
+  return false;
+}
@@ -0,0 +1,59 @@
+#include <stdint.h>
+
+#ifndef ubsub_replayfilter_h
+#define ubsub_replayfilter_h
+
+/**
+Remembers packet nonces for as long as their packets could still pass the
+timestamp check, so a replayed packet can be rejected in O(1).
+
+Nonces are kept in a few hash sets ("buckets"), each holding the nonces that
+expire during one slice of time. A bucket whose slice has passed is cleared in
+one go the next time it's needed, so there are no per-entry deletes and no
+early evictions while a nonce can still be replayed.
+
+Sized for a maximum packet rate; inserting beyond it fails rather than forgetting
+a live nonce.
+**/
+
+#define REPLAYFILTER_BUCKETS 4
+
+class ReplayFilter {
+private:
+  struct Bucket {
+    uint64_t* table;
+    uint64_t slice; // Slice of time whose nonces this holds
+    uint32_t count;
+    bool hasZero; // 0 marks empty table entries, so nonce 0 is tracked separately
+  };
+
+  Bucket buckets[REPLAYFILTER_BUCKETS];
+  uint64_t* storage;
+  uint32_t mask;
+  uint32_t maxItems; // Per bucket
+  uint32_t sliceSeconds;
+  uint32_t windowSeconds;
+
+public:
+  ReplayFilter();
+  ~ReplayFilter();
+
+  // Nonces are kept for up to windowSeconds, at up to maxRate per second.
+  // Returns false if allocation failed
+  bool init(uint32_t windowSeconds, uint32_t maxRate);
+
+  // True if nonce was inserted and hasn't expired yet. now in seconds
+  bool contains(uint64_t nonce, uint64_t now) const;
+
+  // Remembers nonce until expires (seconds, at most now + windowSeconds).
+  // Returns false if the filter is full for that slice of time
+  bool insert(uint64_t nonce, uint64_t expires, uint64_t now);
+
+  void clear();
+
+private:
+  uint32_t slotFor(uint64_t nonce) const;
+  bool probe(const Bucket &bucket, uint64_t nonce) const;
+};
+
+#endif
@@ -0,0 +1,192 @@
+#include <stddef.h>
+#include "timerwheel.h"
+
+#define LEVEL_BITS 6
+#define SLOT_MASK (TIMERWHEEL_SLOTS - 1)
+#define EXPIRED_SLOT (TIMERWHEEL_LEVELS * TIMERWHEEL_SLOTS)
+
+static inline uint64_t rotr64(uint64_t v, int r) {
+  return r == 0 ? v : (v >> r) | (v << (64 - r));
+}
+
+static inline int ctz64(uint64_t v) {
+  return __builtin_ctzll(v);
+}
+
+TimerWheel::TimerWheel() {
+  this->reset(0);
+}
+
+void TimerWheel::reset(uint64_t now) {
+  for (int l=0; l<TIMERWHEEL_LEVELS; ++l) {
+    for (int i=0; i<TIMERWHEEL_SLOTS; ++i)
+      this->slots[l][i] = NULL;
+    this->occupied[l] = 0;
+  }
+  this->expired = NULL;
+  this->current = now;
+  this->count = 0;
+}
+
+void TimerWheel::schedule(TimerNode* node, uint64_t expires) {
+  this->cancel(node);
+  node->expires = expires;
+  this->place(node);
+  this->count++;
+}
+
+void TimerWheel::cancel(TimerNode* node) {
+  if (node->pprev == NULL)
+    return;
+
+  *node->pprev = node->next;
+  if (node->next != NULL)
+    node->next->pprev = node->pprev;
+
+  if (node->slot < EXPIRED_SLOT) {
+    const int level = node->slot / TIMERWHEEL_SLOTS;
+    const int idx = node->slot % TIMERWHEEL_SLOTS;
+    if (this->slots[level][idx] == NULL)
+      this->occupied[level] &= ~(1ULL << idx);
+    this->count--;
+  }
+
+  node->next = NULL;
+  node->pprev = NULL;
+  node->slot = -1;
+}
+
+bool TimerWheel::pending(const TimerNode* node) const {
+  return node->pprev != NULL;
+}
+
+int TimerWheel::expire(uint64_t now) {
+  int moved = 0;
+
+  while (this->current <= now) {
+    if (this->count == 0) {
+      this->current = now + 1;
+      break;
+    }
+
+    // Everything in the current level 0 slot is due
+    const int idx = this->current & SLOT_MASK;
+    TimerNode* node = this->slots[0][idx];
+    this->slots[0][idx] = NULL;
+    this->occupied[0] &= ~(1ULL << idx);
+    while (node != NULL) {
+      TimerNode* next = node->next;
+      this->count--;
+      this->link(&this->expired, node, EXPIRED_SLOT);
+      moved++;
+      node = next;
+    }
+
+    this->current++;
+    if ((this->current & SLOT_MASK) == 0)
+      this->cascade();
+
+    // Skip ahead over ticks where nothing can be due
+    uint64_t next = this->nextWheelExpiry();
+    if (next > this->current && this->current <= now) {
+      this->current = next <= now ? next : now + 1;
+      if ((this->current & SLOT_MASK) == 0)
+        this->cascade();
+    }
+  }
+
+  return moved;
+}
+
+TimerNode* TimerWheel::popExpired() {
+  TimerNode* node = this->expired;
+  if (node != NULL)
+    this->cancel(node);
+  return node;
+}
+
+uint64_t TimerWheel::nextExpiry() const {
+  if (this->expired != NULL)
+    return this->current > 0 ? this->current - 1 : 0;
+  return this->nextWheelExpiry();
+}
+
+int TimerWheel::size() const {
+  int expiredCount = 0;
+  for (TimerNode* node = this->expired; node != NULL; node = node->next)
+    expiredCount++;
+  return this->count + expiredCount;
+}
+
+void TimerWheel::place(TimerNode* node) {
+  uint64_t expires = node->expires < this->current ? this->current : node->expires;
+  uint64_t delta = expires - this->current;
+
+  int level = 0;
+  while (level < TIMERWHEEL_LEVELS - 1 && delta >= (1ULL << (LEVEL_BITS * (level + 1))))
+    level++;
+
+  if (delta >= (1ULL << (LEVEL_BITS * TIMERWHEEL_LEVELS))) {
+    // Beyond the wheel's range; park in the furthest slot and re-place when it cascades
+    expires = this->current + (1ULL << (LEVEL_BITS * TIMERWHEEL_LEVELS)) - 1;
+  }
+
+  const int idx = (expires >> (LEVEL_BITS * level)) & SLOT_MASK;
+  this->link(&this->slots[level][idx], node, level * TIMERWHEEL_SLOTS + idx);
+  this->occupied[level] |= 1ULL << idx;
+}
+
+void TimerWheel::link(TimerNode** head, TimerNode* node, int16_t slot) {
+  node->next = *head;
+  if (*head != NULL)
+    (*head)->pprev = &node->next;
+  *head = node;
+  node->pprev = head;
+  node->slot = slot;
+}
+
+// Called when current reaches a multiple of 64; redistributes the slots of
+// each level whose period starts now, from the top down
+void TimerWheel::cascade() {
+  int top = 1;
+  while (top < TIMERWHEEL_LEVELS - 1 && (this->current & ((1ULL << (LEVEL_BITS * (top + 1))) - 1)) == 0)
+    top++;
+
+  for (int level = top; level >= 1; --level) {
+    const int idx = (this->current >> (LEVEL_BITS * level)) & SLOT_MASK;
+    TimerNode* node = this->slots[level][idx];
+    this->slots[level][idx] = NULL;
+    this->occupied[level] &= ~(1ULL << idx);
+    while (node != NULL) {
+      TimerNode* next = node->next;
+      this->place(node);
+      node = next;
+    }
+  }
+}
+
+uint64_t TimerWheel::nextWheelExpiry() const {
+  if (this->count == 0)
+    return TIMERWHEEL_NEVER;
+
+  uint64_t best = TIMERWHEEL_NEVER;
+
+  // Level 0 slots map directly to the next 64 ticks
+  if (this->occupied[0] != 0) {
+    const int idx = this->current & SLOT_MASK;
+    best = this->current + ctz64(rotr64(this->occupied[0], idx));
+  }
+
+  // Higher levels: start of the first occupied block after the current one
+  for (int level = 1; level < TIMERWHEEL_LEVELS; ++level) {
+    if (this->occupied[level] == 0)
+      continue;
+    const uint64_t block = this->current >> (LEVEL_BITS * level);
+    const int idx = (block + 1) & SLOT_MASK;
+    const uint64_t start = (block + 1 + ctz64(rotr64(this->occupied[level], idx))) << (LEVEL_BITS * level);
+    if (start < best)
+      best = start;
+  }
+
+  return best;
+}
@@ -0,0 +1,82 @@
+#include <stdint.h>
+
+#ifndef ubsub_timerwheel_h
+#define ubsub_timerwheel_h
+
+/**
+Hierarchical timing wheel for scheduling many timers cheaply.
+
+Timers are intrusive TimerNodes embedded in whatever they belong to, so scheduling
+never allocates. There are 4 levels of 64 slots; level 0 holds timers due within 64
+ticks, level 1 within 64^2 and so on, and timers cascade down a level as their time
+approaches. Timers further out than 64^4 ticks are parked in the top level and
+re-cascaded until due. A tick is whatever unit the caller passes in as "now".
+
+expire() only does work for slots that have timers in them, so the cost of a call
+is proportional to the number of due timers, not the number scheduled.
+**/
+
+#define TIMERWHEEL_LEVELS 4
+#define TIMERWHEEL_SLOTS 64
+#define TIMERWHEEL_NEVER 0xFFFFFFFFFFFFFFFFULL
+
+typedef struct TimerNode {
+  TimerNode* next;
+  TimerNode** pprev; // Points at whatever points to us, NULL if not scheduled
+  uint64_t expires;
+  int16_t slot;
+  uint8_t type; // For the owner to identify what fired
+  void* owner;
+} TimerNode;
+
+static inline void initTimer(TimerNode* node, uint8_t type, void* owner) {
+  node->next = 0;
+  node->pprev = 0;
+  node->expires = 0;
+  node->slot = -1;
+  node->type = type;
+  node->owner = owner;
+}
+
+class TimerWheel {
+private:
+  TimerNode* slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+  uint64_t occupied[TIMERWHEEL_LEVELS]; // Bit per non-empty slot
+  TimerNode* expired;
+  uint64_t current; // Next tick to process
+  int count; // Timers in the wheel, excluding the expired list
+
+public:
+  TimerWheel();
+
+  // Drops all timers and sets the current time
+  void reset(uint64_t now);
+
+  // Schedules (or reschedules) node to fire at expires. Times in the past fire on the next expire()
+  void schedule(TimerNode* node, uint64_t expires);
+
+  // Unschedules node, including if it has expired but not yet been popped
+  void cancel(TimerNode* node);
+
+  bool pending(const TimerNode* node) const;
+
+  // Moves every timer due at or before now to the expired list. Returns how many moved
+  int expire(uint64_t now);
+
+  // Takes the next expired timer, or NULL when there are none left
+  TimerNode* popExpired();
+
+  // Earliest time anything could be due, TIMERWHEEL_NEVER if nothing is scheduled.
+  // Exact for timers within 64 ticks, a lower bound beyond that
+  uint64_t nextExpiry() const;
+
+  int size() const;
+
+private:
+  void place(TimerNode* node);
+  void link(TimerNode** head, TimerNode* node, int16_t slot);
+  void cascade();
+  uint64_t nextWheelExpiry() const;
+};
+
+#endif
@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <string.h>
+#include "topictrie.h"
+
+// Length of the level starting at level, and where the next one starts (NULL after the last)
+static int levelLen(const char *level, const char **next) {
+  const char* slash = strchr(level, '/');
+  if (slash == NULL) {
+    *next = NULL;
+    return strlen(level);
+  }
+  *next = slash + 1;
+  return slash - level;
+}
+
+static bool isLabel(const char *label, int len, char wildcard) {
+  return len == 1 && label[0] == wildcard;
+}
+
+TopicTrie::TopicTrie() {
+  this->nodes = NULL;
+  this->nodeCount = 0;
+  this->nodeCapacity = 0;
+  this->labels = NULL;
+  this->labelsLen = 0;
+  this->labelsCapacity = 0;
+  this->count = 0;
+}
+
+TopicTrie::~TopicTrie() {
+  free(this->nodes);
+  free(this->labels);
+}
+
+bool TopicTrie::isPattern(const char *topic) {
+  const char* next = topic;
+  while (next != NULL) {
+    const char* level = next;
+    const int len = levelLen(level, &next);
+    if (isLabel(level, len, '*') || isLabel(level, len, '#'))
+      return true;
+  }
+  return false;
+}
+
+bool TopicTrie::isValidPattern(const char *pattern) {
+  const char* next = pattern;
+  while (next != NULL) {
+    const char* level = next;
+    const int len = levelLen(level, &next);
+    if (isLabel(level, len, '#') && next != NULL)
+      return false;
+  }
+  return true;
+}
+
+bool TopicTrie::insert(const char *pattern, int value) {
+  if (value < 0 || !isValidPattern(pattern))
+    return false;
+
+  if (this->nodeCount == 0) {
+    if (this->addChild(-1, "", 0) < 0)
+      return false;
+  }
+
+  int node = 0;
+  const char* next = pattern;
+  while (next != NULL) {
+    const char* level = next;
+    const int len = levelLen(level, &next);
+    int child = this->findChild(node, level, len);
+    if (child < 0)
+      child = this->addChild(node, level, len);
+    if (child < 0)
+      return false;
+    node = child;
+  }
+
+  if (this->nodes[node].value < 0)
+    this->count++;
+  this->nodes[node].value = value;
+  return true;
+}
+
+int TopicTrie::find(const char *pattern) const {
+  if (this->nodeCount == 0)
+    return -1;
+
+  int node = 0;
+  const char* next = pattern;
+  while (next != NULL && node >= 0) {
+    const char* level = next;
+    const int len = levelLen(level, &next);
+    node = this->findChild(node, level, len);
+  }
+  return node >= 0 ? this->nodes[node].value : -1;
+}
+
+int TopicTrie::match(const char *topic, int *values, int maxValues) const {
+  int found = 0;
+  if (this->nodeCount > 0)
+    this->matchFrom(0, topic, values, maxValues, &found);
+  return found;
+}
+
+void TopicTrie::clear() {
+  this->nodeCount = 0;
+  this->labelsLen = 0;
+  this->count = 0;
+}
+
+int TopicTrie::size() const {
+  return this->count;
+}
+
+int TopicTrie::findChild(int node, const char *label, int len) const {
+  for (int c = this->nodes[node].firstChild; c >= 0; c = this->nodes[c].nextSibling) {
+    const Node &child = this->nodes[c];
+    if (child.labelLen == len && memcmp(this->labels + child.label, label, len) == 0)
+      return c;
+  }
+  return -1;
+}
+
+int TopicTrie::addChild(int node, const char *label, int len) {
+  if (this->nodeCount == this->nodeCapacity) {
+    const int capacity = this->nodeCapacity > 0 ? this->nodeCapacity * 2 : 16;
+    Node* nodes = (Node*)realloc(this->nodes, sizeof(Node) * capacity);
+    if (nodes == NULL)
+      return -1;
+    this->nodes = nodes;
+    this->nodeCapacity = capacity;
+  }
+  if (this->labelsLen + len > this->labelsCapacity) {
+    int capacity = this->labelsCapacity > 0 ? this->labelsCapacity * 2 : 128;
+    while (capacity < this->labelsLen + len)
+      capacity *= 2;
+    if (capacity > 0xFFFF + 1)
+      return -1; // Offsets are 16 bit
+    char* labels = (char*)realloc(this->labels, capacity);
+    if (labels == NULL)
+      return -1;
+    this->labels = labels;
+    this->labelsCapacity = capacity;
+  }
+
+  const int idx = this->nodeCount++;
+  Node &child = this->nodes[idx];
+  child.firstChild = -1;
+  child.value = -1;
+  child.label = this->labelsLen;
+  child.labelLen = len;
+  memcpy(this->labels + this->labelsLen, label, len);
+  this->labelsLen += len;
+
+  if (node >= 0) {
+    child.nextSibling = this->nodes[node].firstChild;
+    this->nodes[node].firstChild = idx;
+  } else {
+    child.nextSibling = -1;
+  }
+  return idx;
+}
+
+// level is what's left of the topic for node's children to match, NULL once all of it has matched
+void TopicTrie::matchFrom(int node, const char *level, int *values, int maxValues, int *found) const {
+  if (level == NULL) {
+    if (this->nodes[node].value >= 0) {
+      if (*found < maxValues)
+        values[*found] = this->nodes[node].value;
+      (*found)++;
+    }
+  }
+
+  const char* next = NULL;
+  const int len = level != NULL ? levelLen(level, &next) : 0;
+  for (int c = this->nodes[node].firstChild; c >= 0; c = this->nodes[c].nextSibling) {
+    const Node &child = this->nodes[c];
+    const char* label = this->labels + child.label;
+
+    if (isLabel(label, child.labelLen, '#')) {
+      // Matches whatever is left, even nothing
+      if (child.value >= 0) {
+        if (*found < maxValues)
+          values[*found] = child.value;
+        (*found)++;
+      }
+    } else if (level != NULL && (isLabel(label, child.labelLen, '*') || (child.labelLen == len && memcmp(label, level, len) == 0))) {
+      this->matchFrom(c, next, values, maxValues, found);
+    }
+  }
+}
@@ -0,0 +1,68 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef ubsub_topictrie_h
+#define ubsub_topictrie_h
+
+/**
+Matches topic names against many patterns at once.
+
+Topics are '/' separated levels. In a pattern, a level of '*' matches any one level,
+and a final level of '#' matches any number of remaining levels, including none
+(so "sensors/#" matches "sensors" and "sensors/a/temp"). Any other level must match
+exactly.
+
+Patterns are stored as a trie with one node per level, so matching a topic walks
+its levels once (branching only at wildcards), however many patterns there are.
+Nodes and labels live in two growable arrays; children are chained as siblings.
+**/
+
+class TopicTrie {
+private:
+  struct Node {
+    int firstChild; // -1 if none
+    int nextSibling; // -1 if none
+    int value; // -1 if no pattern ends here
+    uint16_t label; // Offset in labels
+    uint16_t labelLen;
+  };
+
+  Node* nodes; // nodes[0] is the root, once anything is inserted
+  int nodeCount;
+  int nodeCapacity;
+  char* labels;
+  int labelsLen;
+  int labelsCapacity;
+  int count;
+
+public:
+  TopicTrie();
+  ~TopicTrie();
+
+  // True if topic has a '*' or '#' level
+  static bool isPattern(const char *topic);
+
+  // False if a '#' level isn't the last one
+  static bool isValidPattern(const char *pattern);
+
+  // Adds pattern, or replaces its value. Values must be >= 0.
+  // Returns false if the pattern is invalid or memory ran out
+  bool insert(const char *pattern, int value);
+
+  // Value of exactly this pattern, or -1
+  int find(const char *pattern) const;
+
+  // Writes the values of up to maxValues patterns matching topic. Returns how many matched,
+  // which may be more than maxValues
+  int match(const char *topic, int *values, int maxValues) const;
+
+  void clear();
+  int size() const;
+
+private:
+  int findChild(int node, const char *label, int len) const;
+  int addChild(int node, const char *label, int len);
+  void matchFrom(int node, const char *level, int *values, int maxValues, int *found) const;
+};
+
+#endif
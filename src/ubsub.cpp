@@ -28,6 +28,16 @@
   #include <unistd.h>
   #include <math.h>
   #include <fcntl.h>
+  #include <errno.h>
+  #include <sys/uio.h>
+  #include <netinet/udp.h>
+  #include <time.h>
+  #ifdef __linux__
+    #include <sched.h>
+  #endif
+  #if defined(__linux__) && defined(UDP_SEGMENT) && defined(UDP_GRO)
+    #define UBSUB_HAVE_UDP_OFFLOAD 1
+  #endif
 #endif
 
 const char* DEFAULT_UBSUB_ROUTER = "iot.ubsub.io";
@@ -45,17 +55,20 @@ const char* DEFAULT_NTP_SERVER = "pool.ntp.org";
 #define MSG_FLAG_ACK 0x1
 #define MSG_FLAG_EXTERNAL 0x2
 #define MSG_FLAG_CREATE 0x4
+#define MSG_FLAG_MULTI_ACK 0x8 // Ack may come in a CMD_MSG_MULTI_ACK
 #define MSG_ACK_FLAG_DUPE 0x1
 
 #define SUB_FLAG_ACK 0x1
 #define SUB_FLAG_UNWRAP 0x2
 #define SUB_FLAG_MSG_NEED_ACK 0x4
+#define SUB_FLAG_PATTERN 0x8 // Topic has wildcards, and its events say which topic they're from
 
 #define SUB_ACK_FLAG_DUPE 0x1
 #define SUB_ACK_FLAG_TOPIC_NOT_EXIST 0x2
 
 #define SUB_MSG_FLAG_ACK 0x1
 #define SUB_MSG_FLAG_WAS_UNWRAPPED 0x2
+#define SUB_MSG_FLAG_TOPIC 0x4 // 32 byte topic follows the subscription key
 
 #define SUB_MSG_ACK_FLAG_REJECTED 0x2
 
@@ -67,79 +80,189 @@ const char* DEFAULT_NTP_SERVER = "pool.ntp.org";
 #define CMD_SUB_MSG_ACK 0x6
 #define CMD_MSG         0xA
 #define CMD_MSG_ACK     0xB
+#define CMD_MSG_MULTI_ACK 0xC // Body is (u64 base nonce, u64 bitmap) pairs; bit i acks base+i
 #define CMD_PING        0x10
 #define CMD_PONG        0x11
 
+#define PING_FLAG_MULTI_ACK 0x1 // We understand CMD_MSG_MULTI_ACK
+#define PING_FLAG_BATCH_SUB_ACK 0x2 // We can ack many events in one CMD_SUB_MSG_ACK
+#define PONG_FLAG_MULTI_ACK 0x1 // Router will use it for messages flagged MSG_FLAG_MULTI_ACK
+#define PING_FLAG_PATTERN_ONCE 0x4 // We match pattern events to all our patterns ourselves
+#define PONG_FLAG_BATCH_SUB_ACK 0x2 // Router accepts CMD_SUB_MSG_ACK bodies of many nonces
+#define PONG_FLAG_PATTERN_ONCE 0x4 // Router sends an event matching several of our patterns only once
+
 #define FORMAT_STRING   0x1
 #define FORMAT_INT      0x2
 #define FORMAT_FLOAT    0x3
 
+#define TIMER_RETRY     0x1
+#define TIMER_RENEW     0x2
+#define TIMER_PING      0x3
+#define TIMER_WATCH     0x4
+#define TIMER_TIME_SYNC 0x5
+#define TIMER_PERSIST   0x6
+
+#if !(ARDUINO || PARTICLE)
+// An event copied out of the receive buffer, for one handler to run on a worker thread
+typedef struct WorkerEvent {
+  UbsubHandler handler;
+  uint64_t nonce;
+  int len;
+  uint8_t flags;
+  char topic[33];
+  uint8_t data[UBSUB_MTU];
+} WorkerEvent;
+#endif
 
 //static char* getUniqueDeviceId();
-static int createPacket(uint8_t* buf, int bufSize, const char *deviceId, const char *key, uint16_t cmd, uint8_t flag, const uint64_t &nonce, const uint8_t *body, int bodyLen, const uint8_t *optData, int dataLen);
+static int createPacket(uint8_t* buf, int bufSize, const char *deviceId, const char *key, uint8_t *expandedKey, uint16_t cmd, uint8_t flag, const uint64_t &nonce, const uint8_t *body, int bodyLen, const uint8_t *optData, int dataLen);
+static void restampPacket(uint8_t* buf, int len, const char *key, uint8_t *expandedKey, uint64_t ts);
 static uint64_t getTime();
+static uint64_t getTimeMillis();
 static uint32_t getNonce32();
+static uint64_t hash64(const uint8_t* data, int len);
 static uint64_t getNonce64();
 static int min(int left, int right);
+#if !(ARDUINO || PARTICLE)
+static void runWorkerEvent(void* slot, void* userData);
+static int latencyBucket(uint32_t micros);
+static uint32_t latencyBucketMax(int bucket);
+#endif
 
 // Ubsub Implementation
 
-Ubsub::Ubsub(const char *deviceId, const char *deviceKey, const char *ubsubHost, int ubsubPort) {
-  this->init(deviceId, deviceKey, ubsubHost, ubsubPort);
+Ubsub::Ubsub(const char *deviceId, const char *deviceKey, const char *ubsubHost, int ubsubPort, int queueCapacity) {
+  this->init(deviceId, deviceKey, ubsubHost, ubsubPort, queueCapacity);
 }
 
 Ubsub::Ubsub(const char *deviceId, const char *deviceKey) {
-  this->init(deviceId, deviceKey, DEFAULT_UBSUB_ROUTER, DEFAULT_UBSUB_PORT);
+  this->init(deviceId, deviceKey, DEFAULT_UBSUB_ROUTER, DEFAULT_UBSUB_PORT, UBSUB_QUEUE_CAPACITY);
 }
 
-void Ubsub::init(const char *deviceId, const char *deviceKey, const char *ubsubHost, const int ubsubPort) {
+void Ubsub::init(const char *deviceId, const char *deviceKey, const char *ubsubHost, const int ubsubPort, const int queueCapacity) {
   this->deviceId = deviceId;
   this->deviceKey = deviceKey;
   this->host = ubsubHost;
   this->port = ubsubPort;
   this->socketInit = false;
+  this->batchDepth = 0;
+  #if !(ARDUINO || PARTICLE)
+  this->batchCount = 0;
+  this->batchLen = 0;
+  this->batchSegLen = 0;
+  this->gsoSupported = false;
+  this->groSupported = false;
+  this->sockFamily = AF_INET;
+  this->routerAddrCount = 0;
+  this->routerAddrIdx = 0;
+  this->recvAddrIdx = -1;
+  #endif
+  this->recvBufferBytes = UBSUB_SOCKET_RCVBUF;
+  this->sendBufferBytes = UBSUB_SOCKET_SNDBUF;
+  this->lastKernelDrops = 0;
+  this->busyPollMicros = 0;
+  this->recvBudget = UBSUB_RECV_BUDGET;
+  this->eventRate = 0;
+  this->eventBurst = 0;
+  this->recvPending = false;
+  this->processingDepth = 0;
+  Sha256.init();
+  Sha256.write((uint8_t*)deviceKey, strlen(deviceKey));
+  memcpy(this->expandedKey, Sha256.result(), 32);
+  memset(&this->stats, 0, sizeof(this->stats));
+  #if !(ARDUINO || PARTICLE)
+  memset(this->latencyBuckets, 0, sizeof(this->latencyBuckets));
+  #endif
   this->localPort = getNonce32() % 32768 + 32767;
   for (int i=0; i<UBSUB_ERROR_BUFFER_LEN; ++i) {
     this->lastError[i] = 0;
   }
-  for (int i=0; i<UBSUB_NONCE_RR_COUNT; ++i) {
-    this->rrnonce[i] = 0;
+  // Packets are accepted with timestamps up to UBSUB_PACKET_TIMEOUT either side of now. Besides
+  // events, there's an ack for every queued message to remember
+  const int ackRate = (queueCapacity + UBSUB_PACKET_TIMEOUT - 1) / UBSUB_PACKET_TIMEOUT;
+  if (!this->replayFilter.init(UBSUB_PACKET_TIMEOUT * 2, UBSUB_REPLAY_RATE + ackRate)) {
+    this->setError(UBSUB_ERR_MALLOC);
   }
-  this->lastNonceIdx = 0;
   this->lastPong = 0;
-  this->lastPing = 0;
-  this->queue = NULL;
+  this->multiAck = false;
+  this->batchSubAcks = false;
+  this->patternOnce = false;
+  this->subAckCount = 0;
+  this->subAckSince = 0;
+  this->msgSeq = getNonce64();
+  this->srtt = 0;
+  this->rttvar = 0;
+  this->rto = UBSUB_RTO_INITIAL_MILLIS;
+  this->stats.rtoMillis = this->rto;
+  for (int i=0; i<UBSUB_PRIORITY_CLASSES; ++i) {
+    this->queueHead[i] = NULL;
+    this->queueTail[i] = NULL;
+  }
+  this->queueFree = NULL;
+  this->heldDeliveryCount = 0;
+  this->deliveryHolds = 0;
+  this->queueCapacity = 0;
+  this->queueCount = 0;
+  this->queueBytes = 0;
+  this->sendWindowMessages = 0;
+  this->sendWindowBytes = 0;
+  this->sendWindowBlockMillis = 0;
+  this->queueSlots = (QueuedMessage*)malloc(sizeof(QueuedMessage) * queueCapacity);
+  if (this->queueSlots != NULL && !(this->queueIndex.init(queueCapacity) && this->coalesceIndex.init(queueCapacity))) {
+    free(this->queueSlots);
+    this->queueSlots = NULL;
+  }
+  if (this->queueSlots != NULL) {
+    this->queueCapacity = queueCapacity;
+    for (int i=queueCapacity-1; i>=0; --i) {
+      this->queueSlots[i].next = this->queueFree;
+      this->queueFree = &this->queueSlots[i];
+    }
+  } else {
+    this->setError(UBSUB_ERR_MALLOC);
+  }
   this->autoRetry = true;
   this->subs = NULL;
+  this->subCount = 0;
+  this->subCapacity = 0;
+  this->handlers = NULL;
+  this->handlerCount = 0;
+  this->handlerCapacity = 0;
+  this->retiredSubs = NULL;
+  this->dispatching = false;
   this->watch = NULL;
 
+  this->timers.reset(getTimeMillis());
+  initTimer(&this->pingTimer, TIMER_PING, NULL);
+  initTimer(&this->syncTimer, TIMER_TIME_SYNC, NULL);
+  #if !(ARDUINO || PARTICLE)
+  initTimer(&this->persistTimer, TIMER_PERSIST, NULL);
+  this->persistReplayRef = -1;
+  this->persistReplayDone = true;
+  #endif
+
   this->autoSyncTime = true;
   this->lastTimeSync = 0;
+  this->timers.schedule(&this->syncTimer, getTimeMillis());
   this->watchTopic[0] = '\0';
 
   US_LOG_INFO("DID: %s", this->deviceId);
 }
 
 Ubsub::~Ubsub() {
-  SubscribedFunc *sfunc = this->subs;
-  while(sfunc != NULL) {
-    SubscribedFunc *curr = sfunc;
-    sfunc = sfunc->next;
-    free(curr);
-  }
-
-  QueuedMessage* qmsg = this->queue;
-  while(qmsg != NULL) {
-    QueuedMessage *curr = qmsg;
-    qmsg = qmsg->next;
-    free(curr->buf);
-    free(curr);
-  }
+  free(this->subs);
+  free(this->retiredSubs);
+  free(this->handlers);
+  free(this->queueSlots);
 }
 
 void Ubsub::enableAutoSyncTime(bool enabled) {
   this->autoSyncTime = enabled;
   this->lastTimeSync = 0;
+  if (enabled)
+    this->timers.schedule(&this->syncTimer, getTimeMillis());
+  else
+    this->timers.cancel(&this->syncTimer);
 }
 
 void Ubsub::enableAutoRetry(bool enabled) {
@@ -177,15 +300,25 @@ bool Ubsub::connect(int timeout) {
   }
 
   this->initSocket();
+  this->resolveRouter(); // Re-resolve on every (re)connect in case the router moved
+
+  #if !(ARDUINO || PARTICLE)
+  // Race all resolved addresses; the first to answer with a pong is the one we keep
+  if (this->routerAddrCount > 1)
+    this->routerAddrIdx = -1;
+  #endif
 
   this->lastPong = 0;
+  this->multiAck = false; // Renegotiated with the pong, the router may have changed
+  this->batchSubAcks = false;
+  this->patternOnce = false;
   while(true) {
     US_LOG_DEBUG("Attempting connect...");
     this->ping();
 
     // Wait for pong
-    uint64_t waitEnd = getTime() + 1;
-    while(getTime() < waitEnd && this->lastPong <= 0) {
+    uint64_t waitEnd = getTimeMillis() + 1000;
+    while(getTimeMillis() < waitEnd && this->lastPong <= 0) {
       this->receiveData();
       #if ARDUINO || PARTICLE
       delay(10);
@@ -203,11 +336,18 @@ bool Ubsub::connect(int timeout) {
   }
 
   US_LOG_INFO("Connection established");
+
+  this->replayPersisted();
+  this->replayQueue();
   return true;
 }
 
 
 int Ubsub::publishEvent(const char *topicNameOrId, const char *topicKey, const char *msg) {
+  return this->publishEvent(topicNameOrId, topicKey, msg, PublishOptions());
+}
+
+int Ubsub::publishEvent(const char *topicNameOrId, const char *topicKey, const char *msg, const PublishOptions &options, uint64_t *handle) {
   if (topicNameOrId == NULL) {
     return UBSUB_MISSING_ARGS;
   }
@@ -228,15 +368,87 @@ int Ubsub::publishEvent(const char *topicNameOrId, const char *topicKey, const c
   uint8_t flag = MSG_FLAG_CREATE;
   if (this->autoRetry)
     flag |= MSG_FLAG_ACK;
+  if (this->autoRetry && this->multiAck)
+    flag |= MSG_FLAG_MULTI_ACK;
+
+  // Only the newest value matters. The one still waiting to be acked is dropped once this one
+  // is queued, and its room in the window counts as free until then
+  const uint64_t coalesceKey = this->autoRetry && options.coalesce ? hash64(command+2, COMMAND_LEN-2) : 0;
+
+  const uint8_t priority = options.priority < UBSUB_PRIORITY_CLASSES ? options.priority : UBSUB_PRIORITY_BULK;
+  if (this->autoRetry && !this->waitForSendWindow(UBSUB_CRYPTHEADER_LEN + UBSUB_HEADER_LEN + COMMAND_LEN + msgLen + UBSUB_SIGNATURE_LEN, priority, coalesceKey)) {
+    US_LOG_WARN("Send window full, not publishing");
+    this->setError(UBSUB_ERR_WOULD_BLOCK);
+    return UBSUB_ERR_WOULD_BLOCK;
+  }
+
+  // With every slot taken, the new message needs the one it replaces. The replaced one is told
+  // once the new one is queued, so a publish from its callback can't take the slot first
+  this->holdDeliveries();
+  if (coalesceKey != 0 && this->queueFree == NULL) {
+    const int prev = this->coalesceIndex.get(coalesceKey);
+    if (prev >= 0)
+      this->supersedeMessage(&this->queueSlots[prev]);
+  }
 
-  return this->sendCommand(CMD_MSG, flag, this->autoRetry, getNonce64(), command, COMMAND_LEN, (uint8_t*)msg, msgLen);
+  const uint64_t nonce = this->msgSeq++;
+  if (handle != NULL)
+    *handle = nonce;
+
+  int ret = this->sendCommand(CMD_MSG, flag, this->autoRetry, nonce, command, COMMAND_LEN, (uint8_t*)msg, msgLen, priority);
+
+  const int slot = this->autoRetry ? this->queueIndex.get(nonce) : -1;
+  if (slot >= 0) {
+    QueuedMessage* queued = &this->queueSlots[slot];
+    queued->onDelivery = options.onDelivery;
+    queued->userData = options.userData;
+    if (options.ttlMillis > 0) {
+      queued->expires = queued->sentTime + options.ttlMillis;
+      if (queued->expires < queued->timer.expires)
+        this->timers.schedule(&queued->timer, queued->expires);
+    }
+    if (coalesceKey != 0) {
+      const int prev = this->coalesceIndex.get(coalesceKey);
+      queued->coalesceKey = coalesceKey;
+      this->coalesceIndex.put(coalesceKey, slot);
+      if (prev >= 0 && prev != slot)
+        this->supersedeMessage(&this->queueSlots[prev]);
+    }
+  }
+  this->releaseDeliveries();
+  return ret;
 }
 
 int Ubsub::publishEvent(const char* topicNameOrId, const char* msg) {
   return this->publishEvent(topicNameOrId, NULL, msg);
 }
 
+void UbsubHandler::callTopicCallback(const UbsubEvent& event, void* state) {
+  // String callbacks need a NUL terminated copy
+  char arg[UBSUB_MTU-48+1];
+  pullstr(arg, event.data, event.len < UBSUB_MTU-48 ? event.len : UBSUB_MTU-48);
+  (*(TopicCallback*)state)(arg);
+}
+
+void UbsubHandler::callEventCallback(const UbsubEvent& event, void* state) {
+  (*(EventCallback*)state)(event);
+}
+
+void Ubsub::listenToTopic(const char *topicNameOrId, const UbsubHandler &handler) {
+  SubscribedFunc* sub = this->addSubscription(topicNameOrId);
+  if (sub != NULL && !handler.empty() && !this->addHandler(sub, handler))
+    this->setError(UBSUB_ERR_MALLOC);
+}
+
 void Ubsub::listenToTopic(const char *topicNameOrId, TopicCallback callback) {
+  this->listenToTopic(topicNameOrId, UbsubHandler(callback));
+}
+
+void Ubsub::listenToTopic(const char *topicNameOrId, EventHandler handler, void* userData) {
+  this->listenToTopic(topicNameOrId, UbsubHandler(handler, userData));
+}
+
+SubscribedFunc* Ubsub::addSubscription(const char *topicNameOrId) {
   const int COMMAND_LEN = 44;
   uint8_t command[COMMAND_LEN];
   memset(command, 0, COMMAND_LEN);
@@ -248,33 +460,147 @@ void Ubsub::listenToTopic(const char *topicNameOrId, TopicCallback callback) {
   write_le<uint64_t>(command+34, funcId);
   write_le<uint16_t>(command+42, UBSUB_SUBSCRIPTION_TTL);
 
-  // Register subscription in LL
-  SubscribedFunc* sub = (SubscribedFunc*)malloc(sizeof(SubscribedFunc));
-  memset(sub, 0, sizeof(SubscribedFunc));
-  strncpy(sub->topicNameOrId, topicNameOrId, 16);
-  sub->callback = callback;
-  sub->next = this->subs;
+  // Everyone listening to a topic shares one subscription, and events fan out to their handlers
+  const uint64_t topicHash = hash64(command+2, 32);
+  const int existing = this->subsByTopic.get(topicHash);
+  if (existing >= 0) {
+    US_LOG_INFO("Sharing subscription to '%s' with funcId 0x%s", topicNameOrId, tohexstr(this->subs[existing].funcId));
+    return &this->subs[existing];
+  }
+
+  const bool pattern = TopicTrie::isPattern(topicNameOrId);
+  if (pattern && !TopicTrie::isValidPattern(topicNameOrId)) {
+    US_LOG_WARN("Bad topic pattern '%s', '#' can only be last", topicNameOrId);
+    this->setError(UBSUB_ERR_BAD_PATTERN);
+    return NULL;
+  }
+
+  // Register subscription in table
+  if (this->subCount == this->subCapacity && !this->growSubscriptions()) {
+    this->setError(UBSUB_ERR_MALLOC);
+    return NULL;
+  }
+  const int idx = this->subCount++;
+  SubscribedFunc* sub = &this->subs[idx];
+  *sub = SubscribedFunc();
+  strncpy(sub->topicNameOrId, topicNameOrId, 32);
   sub->funcId = funcId;
   sub->requestNonce = getNonce64();
-  sub->renewTime = getTime() + 5; // Retry frequenctly. Ack will push this out
-  this->subs = sub;
+  sub->topicHash = topicHash;
+  sub->pattern = pattern;
+  sub->firstHandler = -1;
+  sub->lastHandler = -1;
+  sub->rateTokens = 0;
+  sub->rateRefill = 0;
+  this->subsByFuncId.put(sub->funcId, idx);
+  this->subsByNonce.put(sub->requestNonce, idx);
+  this->subsByTopic.put(sub->topicHash, idx);
+  if (pattern && !this->patterns.insert(topicNameOrId, idx))
+    this->setError(UBSUB_ERR_MALLOC);
+  initTimer(&sub->renewTimer, TIMER_RENEW, sub);
+  this->timers.schedule(&sub->renewTimer, getTimeMillis() + 5000); // Retry frequenctly. Ack will push this out
+
+  // Pings keep NAT open for incoming events, so start once we have something to listen to
+  if (!this->timers.pending(&this->pingTimer))
+    this->timers.schedule(&this->pingTimer, getTimeMillis());
 
   US_LOG_INFO("Listening to '%s' with funcId 0x%s...", topicNameOrId, tohexstr(funcId));
 
   this->sendCommand(
     CMD_SUB,
-    SUB_FLAG_ACK | SUB_FLAG_UNWRAP | SUB_FLAG_MSG_NEED_ACK,
+    SUB_FLAG_ACK | SUB_FLAG_UNWRAP | SUB_FLAG_MSG_NEED_ACK | (sub->pattern ? SUB_FLAG_PATTERN : 0),
     this->autoRetry,
     sub->requestNonce,
     command,
     COMMAND_LEN,
     NULL, 0);
+
+  return sub;
+}
+
+bool Ubsub::addHandler(SubscribedFunc* sub, const UbsubHandler &handler) {
+  if (this->handlerCount == this->handlerCapacity) {
+    const int capacity = this->handlerCapacity > 0 ? this->handlerCapacity * 2 : UBSUB_SUBSCRIPTION_CAPACITY;
+    SubscriptionHandler* handlers = (SubscriptionHandler*)realloc(this->handlers, sizeof(SubscriptionHandler) * capacity);
+    if (handlers == NULL)
+      return false;
+    this->handlers = handlers;
+    this->handlerCapacity = capacity;
+  }
+
+  const int idx = this->handlerCount++;
+  this->handlers[idx].handler = handler;
+  this->handlers[idx].next = -1;
+  if (sub->lastHandler >= 0)
+    this->handlers[sub->lastHandler].next = idx;
+  else
+    sub->firstHandler = idx;
+  sub->lastHandler = idx;
+  return true;
+}
+
+// Runs the handlers of each of the subscriptions (indexes in subs) the event is for
+void Ubsub::dispatchEvent(const int* subIdx, int subCount, const UbsubEvent &event) {
+  // Handlers may subscribe to more topics, which can move the tables they and the topic live in.
+  // Each handler is called from a copy, and the old subscription table is kept until done
+  this->dispatching = true;
+  for (int i=0; i<subCount; ++i) {
+    for (int h = this->subs[subIdx[i]].firstHandler; h >= 0; h = this->handlers[h].next) {
+      const UbsubHandler handler = this->handlers[h].handler;
+      handler(event);
+    }
+  }
+  this->dispatching = false;
+  free(this->retiredSubs);
+  this->retiredSubs = NULL;
+}
+
+#if !(ARDUINO || PARTICLE)
+// Worker to run an event's handlers, or -1 if its queue can't take all of them. Only this
+// thread fills the queues, so the room is still there when offloadEvent is called
+int Ubsub::offloadWorker(const int* subIdx, int subCount, const UbsubEvent &event) {
+  // A topic always goes to the same worker, so its events run in order
+  const int worker = (int)(hash64((const uint8_t*)event.topic, strlen(event.topic)) % (uint64_t)this->workers.size());
+
+  // All or nothing, so an event left un-acked can be resent without repeating any handler
+  int handlerCount = 0;
+  for (int i=0; i<subCount; ++i) {
+    for (int h = this->subs[subIdx[i]].firstHandler; h >= 0; h = this->handlers[h].next)
+      handlerCount++;
+  }
+  if (event.len > UBSUB_MTU || this->workers.available(worker) < handlerCount)
+    return -1;
+  return worker;
+}
+
+void Ubsub::offloadEvent(int worker, const int* subIdx, int subCount, const UbsubEvent &event) {
+  for (int i=0; i<subCount; ++i) {
+    for (int h = this->subs[subIdx[i]].firstHandler; h >= 0; h = this->handlers[h].next) {
+      WorkerEvent* slot = (WorkerEvent*)this->workers.reserve(worker);
+      slot->handler = this->handlers[h].handler;
+      slot->nonce = event.nonce;
+      slot->len = event.len;
+      slot->flags = event.flags;
+      strcpy(slot->topic, event.topic);
+      memcpy(slot->data, event.data, event.len);
+      this->workers.commit(worker);
+    }
+  }
+}
+#endif
+
+void Ubsub::createFunction(const char *name, const UbsubHandler &handler) {
+  this->listenToTopic(name, handler);
 }
 
 void Ubsub::createFunction(const char *name, TopicCallback callback) {
   this->listenToTopic(name, callback);
 }
 
+void Ubsub::createFunction(const char *name, EventHandler handler, void* userData) {
+  this->listenToTopic(name, handler, userData);
+}
+
 int Ubsub::callFunction(const char *name, const char *arg) {
   return this->publishEvent(name, NULL, arg);
 }
@@ -293,7 +619,8 @@ void Ubsub::watchVariable(const char *name, const void* ptr, int len, uint8_t fo
   watch->format = format;
   watch->ptr = (uint8_t*)ptr;
   watch->len = len;
-  watch->lastCheck = 0;
+  initTimer(&watch->timer, TIMER_WATCH, watch);
+  this->timers.schedule(&watch->timer, getTimeMillis());
 
   watch->next = this->watch;
   this->watch = watch;
@@ -323,49 +650,90 @@ const int Ubsub::getLastError() {
 }
 
 void Ubsub::processEvents() {
-  // Kick off time sync if needed
-  if (this->autoSyncTime && getTime() >= this->lastTimeSync + UBSUB_TIME_SYNC_FREQ) {
-    this->syncTime();
-  }
-
-  // Send ping if necessary
-  // If we don't have any subs, no reason to constantly ping, as it's mostly for NAT negotiation
-  if (this->subs != NULL) {
-    uint64_t now = getTime();
-    if (now - this->lastPing >= UBSUB_PING_FREQ) {
-      this->lastPing = now;
-      this->ping();
-    }
+  // Receive and process data
+  this->receiveData();
 
-    if (this->lastPong > 0 && now - this->lastPong > UBSUB_CONNECTION_TIMEOUT) {
-      US_LOG_WARN("Haven't received pong.. lost connection?");
-      // Attempt reconnection
-      this->invalidateSubscriptions();
-      this->connect();
-    }
+  // Retries, pings, renewals, watches and time sync that are due
+  this->processTimers();
 
-    // Renew any subscriptions that need it
-    this->renewSubscriptions();
+  #if !(ARDUINO || PARTICLE)
+  // Low-latency mode: keep spinning on the socket rather than handing back to a sleeping caller
+  if (this->busyPollMicros > 0 && this->socketInit) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+      this->receiveData();
+      clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000 < this->busyPollMicros);
   }
+  #endif
+}
 
-  // Receive and process data
-  this->receiveData();
+int Ubsub::getQueueSize() {
+  return this->queueCount;
+}
+
+int Ubsub::getNextWakeup() {
+  // Datagrams left in the socket by the receive budget
+  if (this->recvPending)
+    return 0;
+
+  const uint64_t next = this->timers.nextExpiry();
+  if (next == TIMERWHEEL_NEVER)
+    return -1;
 
-  // Process queued events
-  this->processQueue();
+  const uint64_t now = getTimeMillis();
+  if (next <= now)
+    return 0;
+  return next - now > 24*60*60*1000 ? 24*60*60*1000 : (int)(next - now);
+}
 
-  // Watch variables for changes
-  this->checkWatchedVariables();
+void Ubsub::setSendWindow(int maxMessages, int maxBytes, int blockMillis) {
+  this->sendWindowMessages = maxMessages;
+  this->sendWindowBytes = maxBytes;
+  this->sendWindowBlockMillis = blockMillis;
 }
 
-int Ubsub::getQueueSize() {
-  int count = 0;
-  QueuedMessage* msg = this->queue;
-  while(msg != NULL) {
-    count++;
-    msg = msg->next;
+void Ubsub::setReceiveBudget(int packets) {
+  this->recvBudget = packets > 0 ? packets : 0;
+}
+
+void Ubsub::setEventRateLimit(int eventsPerSec, int burst) {
+  this->eventRate = eventsPerSec > 0 ? eventsPerSec : 0;
+  this->eventBurst = burst > 0 ? burst : this->eventRate;
+  for (int i=0; i<this->subCount; ++i)
+    this->subs[i].rateRefill = 0; // Start full
+}
+
+bool Ubsub::enablePersistentQueue(const char *dir) {
+  #if !(ARDUINO || PARTICLE)
+  if (!this->persist.open(dir, UBSUB_PERSIST_SEGMENT_BYTES, UBSUB_PERSIST_MAX_SEGMENTS)) {
+    US_LOG_WARN("Unable to open persistent queue in %s", dir);
+    return false;
   }
-  return count;
+  this->persistReplayRef = -1;
+  this->persistReplayDone = false;
+  US_LOG_INFO("Persistent queue in %s has %d un-acked messages", dir, this->persist.size());
+  return true;
+  #else
+  return false;
+  #endif
+}
+
+bool Ubsub::enableWorkerPool(int workers, int queueDepth) {
+  #if !(ARDUINO || PARTICLE)
+  this->workers.stop();
+  if (workers <= 0)
+    return true;
+  if (!this->workers.start(workers, queueDepth, sizeof(WorkerEvent), runWorkerEvent, NULL)) {
+    US_LOG_WARN("Unable to start %d workers", workers);
+    return false;
+  }
+  US_LOG_INFO("Running handlers on %d workers", workers);
+  return true;
+  #else
+  return false;
+  #endif
 }
 
 void Ubsub::flush(int timeout) {
@@ -382,6 +750,69 @@ void Ubsub::flush(int timeout) {
   US_LOG_DEBUG("Flushed");
 }
 
+const UbsubStats& Ubsub::getStats() {
+  #if !(ARDUINO || PARTICLE)
+  // Percentiles are derived from the histogram on demand
+  uint32_t* const targets[] = { &this->stats.latencyP50Micros, &this->stats.latencyP90Micros, &this->stats.latencyP99Micros };
+  const uint32_t thresholds[] = { 50, 90, 99 };
+  int t = 0;
+  uint64_t seen = 0;
+  for (int i=0; i<UBSUB_LATENCY_BUCKETS && t < 3; ++i) {
+    seen += this->latencyBuckets[i];
+    while (t < 3 && this->stats.latencySamples > 0 && seen * 100 >= (uint64_t)this->stats.latencySamples * thresholds[t]) {
+      const uint32_t bucketMax = latencyBucketMax(i);
+      *targets[t++] = bucketMax < this->stats.latencyMaxMicros ? bucketMax : this->stats.latencyMaxMicros;
+    }
+  }
+  #endif
+  return this->stats;
+}
+
+void Ubsub::resetStats() {
+  const int recvBufferSize = this->stats.recvBufferSize;
+  const int sendBufferSize = this->stats.sendBufferSize;
+  memset(&this->stats, 0, sizeof(this->stats));
+  this->stats.recvBufferSize = recvBufferSize;
+  this->stats.sendBufferSize = sendBufferSize;
+  this->stats.srttMillis = this->srtt;
+  this->stats.rttvarMillis = this->rttvar;
+  this->stats.rtoMillis = this->rto;
+  #if !(ARDUINO || PARTICLE)
+  memset(this->latencyBuckets, 0, sizeof(this->latencyBuckets));
+  #endif
+}
+
+void Ubsub::setSocketBuffers(int recvBytes, int sendBytes) {
+  this->recvBufferBytes = recvBytes;
+  this->sendBufferBytes = sendBytes;
+}
+
+void Ubsub::enableBusyPoll(int spinMicros, int cpu) {
+  this->busyPollMicros = spinMicros > 0 ? spinMicros : 0;
+  this->applyBusyPoll();
+
+  #ifdef __linux__
+  if (cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+      US_LOG_WARN("Unable to pin thread to cpu %d", cpu);
+    }
+  }
+  #endif
+}
+
+void Ubsub::beginBatch() {
+  this->batchDepth++;
+}
+
+void Ubsub::endBatch() {
+  if (this->batchDepth > 0 && --this->batchDepth == 0) {
+    this->flushBatch();
+  }
+}
+
 
 
 
@@ -419,12 +850,18 @@ void Ubsub::processPacket(uint8_t *buf, int len) {
     return;
   }
 
-  //Validate Nonce hasn't already been used (dupe)
-  if (this->hasNonce(nonce)) {
+  //Validate Nonce hasn't already been used (dupe). Cheap, so done before the signature
+  uint64_t now = getTime();
+  if (this->replayFilter.contains(nonce, now)) {
     this->setError(UBSUB_ERR_NONCE_DUPE);
     return;
   }
-  this->writeNonce(nonce);
+
+  // Shed floods of events before they cost a signature check
+  if (this->eventRate > 0 && !this->admitEvent(buf, len, version, nonce)) {
+    this->stats.rateLimitedEvents++;
+    return;
+  }
 
   // Test the signature
   Sha256.initHmac((uint8_t*)this->deviceKey, strlen(this->deviceKey));
@@ -438,10 +875,7 @@ void Ubsub::processPacket(uint8_t *buf, int len) {
 
   // If version 0x3, need to run through cipher
   if (version == 0x3) {
-    Sha256.init();
-    Sha256.write((uint8_t*)this->deviceKey, strlen(this->deviceKey));
-    uint8_t* expandedKey = Sha256.result();
-    s20_crypt(expandedKey, S20_KEYLEN_256, (uint8_t*)&nonce, 0, buf+25, len - UBSUB_CRYPTHEADER_LEN - UBSUB_SIGNATURE_LEN);
+    s20_crypt(this->expandedKey, S20_KEYLEN_256, (uint8_t*)&nonce, 0, buf+25, len - UBSUB_CRYPTHEADER_LEN - UBSUB_SIGNATURE_LEN);
   }
 
   uint64_t ts = read_le<uint64_t>(buf+25);
@@ -450,22 +884,82 @@ void Ubsub::processPacket(uint8_t *buf, int len) {
   uint8_t flag = *(uint8_t*)(buf+37);
 
   uint8_t* body = buf + 38;
+  if (bodyLen > len - UBSUB_FULL_HEADER_LEN - UBSUB_SIGNATURE_LEN) {
+    this->setError(UBSUB_ERR_INVALID_PACKET);
+    return;
+  }
 
   // Validate timestamp is within bounds
-  uint64_t now = getTime();
   int diff = (int64_t)now - (int64_t)ts; // Signed cause could be negative
   if (diff < -UBSUB_PACKET_TIMEOUT || diff > UBSUB_PACKET_TIMEOUT) {
     this->setError(UBSUB_ERR_TIMEOUT);
     return;
   }
 
-  processCommand(cmd, flag, nonce, body, bodyLen);
+  // Only authentic packets are remembered, so forged ones can't fill the filter.
+  // A packet can be replayed until its timestamp falls out of bounds. Events are remembered
+  // once they're accepted (see rememberEvent). Anything else (acks, pongs) does no harm
+  // handled twice, so isn't dropped if the filter is full
+  if (cmd != CMD_SUB_MSG && !this->replayFilter.insert(nonce, ts + UBSUB_PACKET_TIMEOUT, now))
+    US_LOG_DEBUG("Replay filter full, not remembering command %d", cmd);
+
+  processCommand(cmd, flag, nonce, ts, body, bodyLen);
+}
+
+// Remembers the nonce of an event about to be handled, so a replay of it is rejected. If the
+// filter is full the event is dropped un-acked instead, for the router to send again later
+bool Ubsub::rememberEvent(const uint64_t &nonce, uint64_t ts) {
+  if (!this->replayFilter.insert(nonce, ts + UBSUB_PACKET_TIMEOUT, getTime())) {
+    this->setError(UBSUB_ERR_REPLAY_FULL);
+    return false;
+  }
+  return true;
+}
+
+// Takes a token from the bucket of the subscription an event is for, false if it's empty.
+// Reads the command and funcId before the packet is authenticated, which only needs the
+// first cipher block. A forged packet can spend a subscription's tokens, but can't get
+// anything past the signature check
+bool Ubsub::admitEvent(const uint8_t *buf, int len, uint8_t version, uint64_t nonce) {
+  if (len < UBSUB_FULL_HEADER_LEN + 8 + UBSUB_SIGNATURE_LEN)
+    return true; // Rejected properly later
+
+  uint8_t head[UBSUB_HEADER_LEN + 8]; // ts, cmd, bodyLen, flag, funcId
+  memcpy(head, buf + UBSUB_CRYPTHEADER_LEN, sizeof(head));
+  if (version == 0x3)
+    s20_crypt(this->expandedKey, S20_KEYLEN_256, (uint8_t*)&nonce, 0, head, sizeof(head));
+
+  if (read_le<uint16_t>(head+8) != CMD_SUB_MSG)
+    return true;
+  const int idx = this->subsByFuncId.get(read_le<uint64_t>(head+UBSUB_HEADER_LEN));
+  if (idx < 0)
+    return true;
+
+  // Tokens are thousandths of an event, so integer refills don't lose the fractions
+  SubscribedFunc* sub = &this->subs[idx];
+  const uint64_t now = getTimeMillis();
+  const uint64_t burst = (uint64_t)this->eventBurst * 1000;
+  const uint32_t full = burst < 0xFFFFFFFF ? (uint32_t)burst : 0xFFFFFFFF;
+  if (sub->rateRefill == 0) {
+    sub->rateTokens = full;
+  } else if (now > sub->rateRefill) {
+    const uint64_t tokens = sub->rateTokens + (now - sub->rateRefill) * (uint64_t)this->eventRate;
+    sub->rateTokens = tokens < full ? (uint32_t)tokens : full;
+  }
+  sub->rateRefill = now;
+
+  if (sub->rateTokens < 1000) {
+    US_LOG_DEBUG("Shedding event for func 0x%s over its rate limit", tohexstr(sub->funcId));
+    return false;
+  }
+  sub->rateTokens -= 1000;
+  return true;
 }
 
-void Ubsub::processCommand(uint16_t cmd, uint8_t flag, const uint64_t &nonce, const uint8_t* body, int bodyLen) {
+void Ubsub::processCommand(uint16_t cmd, uint8_t flag, const uint64_t &nonce, uint64_t ts, const uint8_t* body, int bodyLen) {
   US_LOG_DEBUG("Received command %d with %d byte command. flag: %d", cmd, bodyLen, flag);
 
-  uint64_t now = getTime();
+  uint64_t now = getTimeMillis();
 
   switch(cmd) {
     case CMD_PONG: // Pong
@@ -476,12 +970,23 @@ void Ubsub::processCommand(uint16_t cmd, uint8_t flag, const uint64_t &nonce, co
       }
       #ifdef UBSUB_US_LOG_DEBUG
       uint64_t pingTime = read_le<uint64_t>(body);
-      int32_t roundTrip = (int32_t)((int64_t)now - (int64_t)pingTime);
+      int32_t roundTrip = (int32_t)((int64_t)getTime() - (int64_t)pingTime);
       US_LOG_DEBUG("Got pong. Round trip secs: %d", roundTrip);
       #endif
       if (now > this->lastPong) {
         this->lastPong = now;
       }
+      if (!this->multiAck && (flag & PONG_FLAG_MULTI_ACK))
+        US_LOG_INFO("Router supports multi-acks");
+      this->multiAck = (flag & PONG_FLAG_MULTI_ACK) != 0;
+      this->batchSubAcks = (flag & PONG_FLAG_BATCH_SUB_ACK) != 0;
+      this->patternOnce = (flag & PONG_FLAG_PATTERN_ONCE) != 0;
+      #if !(ARDUINO || PARTICLE)
+      if (this->routerAddrIdx < 0 && this->recvAddrIdx >= 0) {
+        US_LOG_INFO("Router address %d answered first, using it", this->recvAddrIdx);
+        this->routerAddrIdx = this->recvAddrIdx;
+      }
+      #endif
       break;
     }
     case CMD_SUB_ACK:
@@ -495,13 +1000,17 @@ void Ubsub::processCommand(uint16_t cmd, uint8_t flag, const uint64_t &nonce, co
       if (!(flag & SUB_ACK_FLAG_TOPIC_NOT_EXIST)) {
         SubscribedFunc* sub = this->getSubscribedFuncByNonce(ackNonce);
         if (sub != NULL) {
+          this->subsByNonce.remove(sub->requestNonce);
           sub->requestNonce = 0;
-          pullstr(sub->topicNameOrId, body+16, 16);
+          pullstr(sub->topicId, body+16, 16);
           pullstr(sub->subscriptionId, body+32, 16);
           pullstr(sub->subscriptionKey, body+48, 32);
           sub->renewTime = read_le<uint64_t>(body+80);
+          // renewTime is wall-clock seconds; timers run on the monotonic millisecond clock
+          const uint64_t wallNow = getTime();
+          this->timers.schedule(&sub->renewTimer, now + (sub->renewTime > wallNow ? (sub->renewTime - wallNow) * 1000 : 0));
 
-          US_LOG_INFO("Received subscription ack for func 0x%s topic %s: %s key %s", tohexstr(sub->funcId), sub->topicNameOrId, sub->subscriptionId, sub->subscriptionKey);
+          US_LOG_INFO("Received subscription ack for func 0x%s topic %s (%s): %s key %s", tohexstr(sub->funcId), sub->topicNameOrId, sub->topicId, sub->subscriptionId, sub->subscriptionKey);
         } else {
           US_LOG_WARN("Received sub ack for unknown subscription 0x%s", tohexstr(ackNonce));
         }
@@ -514,31 +1023,85 @@ void Ubsub::processCommand(uint16_t cmd, uint8_t flag, const uint64_t &nonce, co
     }
     case CMD_SUB_MSG:
     {
-      if (bodyLen < 40) {
+      // Events of pattern subscriptions also say which topic they were published to
+      const int dataOffset = (flag & SUB_MSG_FLAG_TOPIC) ? 72 : 40;
+      if (bodyLen < dataOffset) {
         this->setError(UBSUB_ERR_BAD_REQUEST);
         return;
       }
       char subscriptionKey[33];
-      char event[UBSUB_MTU-48+1];
       uint64_t funcId = read_le<uint64_t>(body+0);
       pullstr(subscriptionKey, body+8, 32);
-      pullstr(event, body+40, bodyLen - 40);
 
-      US_LOG_INFO("Received event from func 0x%s with key %s: %s", tohexstr(funcId), subscriptionKey, event);
+      US_LOG_INFO("Received event from func 0x%s with key %s: %.*s", tohexstr(funcId), subscriptionKey, bodyLen - dataOffset, (const char*)body+dataOffset);
 
-      // Ack data, if requested. Defer sending until we know flag
+      // Rejections are acked straight away, accepted events may be batched (see ackEvent)
       uint8_t msgAck[8];
       write_le(msgAck, nonce);
 
       // Call correct function to notify a message has arrived
       SubscribedFunc* sub = this->getSubscribedFuncByFuncId(funcId);
       if (sub != NULL && strcmp(sub->subscriptionKey, subscriptionKey) == 0) {
-        // Send ack before processing  in case slow
+        // The event views the body in place, and is shared by every handler of the topic
+        UbsubEvent event;
+        event.topic = sub->pattern || sub->topicId[0] == '\0' ? sub->topicNameOrId : sub->topicId;
+        event.data = body + dataOffset;
+        event.len = bodyLen - dataOffset;
+        event.nonce = nonce;
+        event.flags = flag;
+
+        int targets[UBSUB_MAX_PATTERN_MATCHES];
+        int targetCount = 1;
+        targets[0] = sub - this->subs;
+
+        char topic[33];
+        if (flag & SUB_MSG_FLAG_TOPIC) {
+          pullstr(topic, body+40, 32);
+          event.topic = topic;
+
+          // If the router sends a matching event once, however many of our patterns match it, it's
+          // ours to pass to all of them. Otherwise each pattern gets its own copy
+          if (sub->pattern && this->patternOnce) {
+            const int matched = this->patterns.match(topic, targets, UBSUB_MAX_PATTERN_MATCHES);
+            if (matched > UBSUB_MAX_PATTERN_MATCHES)
+              US_LOG_WARN("Topic %s matches %d patterns, only handling %d", topic, matched, UBSUB_MAX_PATTERN_MATCHES);
+            targetCount = min(matched, UBSUB_MAX_PATTERN_MATCHES);
+            if (targetCount == 0) {
+              targets[0] = sub - this->subs;
+              targetCount = 1;
+            }
+          }
+        }
+
+        #if !(ARDUINO || PARTICLE)
+        if (this->workers.isRunning()) {
+          // Left un-acked and not remembered, so the router can send it again once there's room
+          const int worker = this->offloadWorker(targets, targetCount, event);
+          if (worker < 0) {
+            this->stats.workerDrops++;
+            US_LOG_WARN("Worker queue full, not taking event from func 0x%s", tohexstr(funcId));
+            break;
+          }
+          if (!this->rememberEvent(nonce, ts))
+            break;
+          this->offloadEvent(worker, targets, targetCount, event);
+          if (flag & SUB_MSG_FLAG_ACK)
+            this->ackEvent(nonce);
+          break;
+        }
+        #endif
+
+        if (!this->rememberEvent(nonce, ts))
+          break;
+
+        // Ack before processing in case slow. Acks held for a batch keep building up, unless
+        // they've waited long enough that a slow handler could make the router resend
         if (flag & SUB_MSG_FLAG_ACK)
-          this->sendCommand(CMD_SUB_MSG_ACK, 0x0, false, msgAck, sizeof(msgAck));
+          this->ackEvent(nonce);
+        if (this->subAckCount > 0 && getTimeMillis() - this->subAckSince >= UBSUB_SUB_ACK_DELAY_MILLIS)
+          this->flushEventAcks();
 
-        if (sub->callback != NULL)
-          sub->callback(event);
+        this->dispatchEvent(targets, targetCount, event);
 
       } else if (sub != NULL) {
         if (flag & SUB_MSG_FLAG_ACK)
@@ -563,7 +1126,28 @@ void Ubsub::processCommand(uint16_t cmd, uint8_t flag, const uint64_t &nonce, co
       if (flag & MSG_ACK_FLAG_DUPE) {
         US_LOG_WARN("Msg ack was dupe");
       }
-      this->removeQueue(msgNonce);
+      this->removeQueue(msgNonce, (flag & MSG_ACK_FLAG_DUPE) ? UBSUB_DELIVERY_DUPE : UBSUB_DELIVERY_ACKED);
+      break;
+    }
+    case CMD_MSG_MULTI_ACK:
+    {
+      if (bodyLen < 16 || bodyLen % 16 != 0) {
+        this->setError(UBSUB_ERR_BAD_REQUEST);
+        return;
+      }
+      const int status = (flag & MSG_ACK_FLAG_DUPE) ? UBSUB_DELIVERY_DUPE : UBSUB_DELIVERY_ACKED;
+      int count = 0;
+      for (int i=0; i<bodyLen; i+=16) {
+        const uint64_t base = read_le<uint64_t>(body+i);
+        uint64_t bitmap = read_le<uint64_t>(body+i+8);
+        for (int bit=0; bitmap != 0; ++bit, bitmap >>= 1) {
+          if (bitmap & 1) {
+            this->removeQueue(base + bit, status);
+            count++;
+          }
+        }
+      }
+      US_LOG_INFO("Got multi-ack for %d messages", count);
       break;
     }
     default:
@@ -573,154 +1157,568 @@ void Ubsub::processCommand(uint16_t cmd, uint8_t flag, const uint64_t &nonce, co
   }
 }
 
-QueuedMessage* Ubsub::queueMessage(const uint8_t* buf, int bufLen, const uint64_t &nonce) {
-  QueuedMessage *msg = (QueuedMessage*)malloc(sizeof(QueuedMessage));
+QueuedMessage* Ubsub::queueMessage(const uint8_t* buf, int bufLen, const uint64_t &nonce, uint8_t priority, bool persist) {
+  // Higher classes can push out queued bulk messages
+  while (this->queueFree == NULL && priority < UBSUB_PRIORITY_BULK && this->shedQueue());
+
+  QueuedMessage *msg = this->queueFree;
   if (msg == NULL) {
-    this->setError(UBSUB_ERR_MALLOC);
+    this->setError(UBSUB_ERR_QUEUE_FULL);
     return NULL;
   }
+  this->queueFree = msg->next;
 
-  msg->buf = (uint8_t*)malloc(bufLen);
-  if (msg->buf == NULL) {
-    this->setError(UBSUB_ERR_MALLOC);
-    free(msg);
-    return NULL;
-  }
   msg->bufLen = bufLen;
-  msg->retryTime = getTime() + UBSUB_PACKET_RETRY_SECONDS;
   msg->retryNumber = 0;
+  msg->sentTime = getTimeMillis();
+  msg->expires = 0;
+  msg->stampTime = getTime();
+  initTimer(&msg->timer, TIMER_RETRY, msg);
+  this->timers.schedule(&msg->timer, msg->sentTime + this->retryDelay(0));
   msg->cancelNonce = nonce;
-  msg->next = this->queue;
+  msg->coalesceKey = 0;
+  msg->priority = priority;
+  msg->next = NULL;
+  msg->prev = this->queueTail[priority];
+  if (msg->prev != NULL)
+    msg->prev->next = msg;
+  else
+    this->queueHead[priority] = msg;
+  this->queueTail[priority] = msg;
 
   memcpy(msg->buf, buf, bufLen);
 
-  this->queue = msg;
+  msg->persistRef = -1;
+  msg->onDelivery = NULL;
+  msg->userData = NULL;
+  #if !(ARDUINO || PARTICLE)
+  if (persist && this->persist.isOpen()) {
+    msg->persistRef = this->persist.append(nonce, buf, bufLen, priority);
+    if (msg->persistRef < 0)
+      US_LOG_WARN("Persistent queue full, 0x%s is only queued in memory", tohexstr(nonce));
+    else if (!this->timers.pending(&this->persistTimer))
+      this->timers.schedule(&this->persistTimer, getTimeMillis() + UBSUB_PERSIST_SYNC_MILLIS);
+  }
+  #endif
+
+  this->queueCount++;
+  this->queueBytes += bufLen;
+  this->queueIndex.put(nonce, msg - this->queueSlots);
 
   US_LOG_DEBUG("Queued %d bytes with nonce 0x%s for retry", bufLen, tohexstr(nonce));
 
   return msg;
 }
 
-void Ubsub::removeQueue(const uint64_t &nonce) {
-  QueuedMessage** prevNext = &this->queue;
-  QueuedMessage* msg = this->queue;
-  while(msg != NULL) {
-    if (msg->cancelNonce == nonce) {
-      US_LOG_DEBUG("Removing 0x%s from queue", tohexstr(nonce));
-      *prevNext = msg->next;
-      free(msg->buf);
-      free(msg);
-      return;
-    }
+void Ubsub::removeQueue(const uint64_t &nonce, int status) {
+  int slot = this->queueIndex.get(nonce);
+  if (slot < 0) {
+    US_LOG_DEBUG("Unable to remove 0x%s from queue, not found", tohexstr(nonce));
+    return;
+  }
+
+  US_LOG_DEBUG("Removing 0x%s from queue", tohexstr(nonce));
+  QueuedMessage* msg = &this->queueSlots[slot];
+
+  // Karn's rule: an ack for a retransmitted message can't be matched to a send, so don't sample it
+  if (msg->retryNumber == 0)
+    this->sampleRtt((uint32_t)(getTimeMillis() - msg->sentTime));
+
+  this->completeMessage(msg, status);
+}
 
-    prevNext = &msg->next;
-    msg = msg->next;
+void Ubsub::removeQueue(QueuedMessage* msg) {
+  if (msg->prev != NULL)
+    msg->prev->next = msg->next;
+  else
+    this->queueHead[msg->priority] = msg->next;
+  if (msg->next != NULL)
+    msg->next->prev = msg->prev;
+  else
+    this->queueTail[msg->priority] = msg->prev;
+
+  this->queueIndex.remove(msg->cancelNonce);
+  if (msg->coalesceKey != 0 && this->coalesceIndex.get(msg->coalesceKey) == msg - this->queueSlots)
+    this->coalesceIndex.remove(msg->coalesceKey);
+  this->timers.cancel(&msg->timer);
+  this->queueCount--;
+  this->queueBytes -= msg->bufLen;
+
+  // Whether acked or given up on, it's not resent after a restart either
+  #if !(ARDUINO || PARTICLE)
+  if (msg->persistRef >= 0) {
+    this->persist.ack(msg->persistRef);
+    if (!this->timers.pending(&this->persistTimer))
+      this->timers.schedule(&this->persistTimer, getTimeMillis() + UBSUB_PERSIST_SYNC_MILLIS);
   }
+  #endif
 
-  US_LOG_DEBUG("Unable to remove 0x%s from queue, not found", tohexstr(nonce));
+  msg->next = this->queueFree;
+  this->queueFree = msg;
 }
 
-void Ubsub::processQueue() {
-  uint64_t now = getTime();
+void Ubsub::processTimers() {
+  const uint64_t now = getTimeMillis();
+  if (this->timers.expire(now) == 0)
+    return;
 
-  QueuedMessage *msg = this->queue;
-  while(msg != NULL) {
-    if (now >= msg->retryTime) {
-      US_LOG_INFO("Retrying message 0x%s", tohexstr(msg->cancelNonce));
-      msg->retryTime = now + UBSUB_PACKET_RETRY_SECONDS;
-      msg->retryNumber++;
+  // Callbacks run from here can publish, which mustn't re-enter it (see waitForSendWindow)
+  this->processingDepth++;
 
-      this->sendData(msg->buf, msg->bufLen);
+  // Retries that come due together go out as one batch
+  this->beginBatch();
+
+  // Watched variables that changed are published together
+  char buf[128]; // stack buffer
+  MiniJsonBuilder json(buf, sizeof(buf));
+  json.open();
 
-      if (msg->retryNumber >= UBSUB_PACKET_RETRY_ATTEMPTS) {
-        US_LOG_WARN("Retried max times, timing out");
-        this->removeQueue(msg->cancelNonce);
-        return; // Pointer is no longer valid, abort so we don't get memory issues
+  bool reconnect = false;
+
+  // Due retries are collected per class, then sent highest class first
+  QueuedMessage* dueHead[UBSUB_PRIORITY_CLASSES] = { NULL };
+  QueuedMessage* dueTail[UBSUB_PRIORITY_CLASSES] = { NULL };
+
+  // Handlers may cancel other expired timers, so pop one at a time rather than walking the list
+  TimerNode* timer;
+  while ((timer = this->timers.popExpired()) != NULL) {
+    switch(timer->type) {
+      case TIMER_RETRY:
+      {
+        QueuedMessage* msg = (QueuedMessage*)timer->owner;
+        msg->dueNext = NULL;
+        if (dueTail[msg->priority] != NULL)
+          dueTail[msg->priority]->dueNext = msg;
+        else
+          dueHead[msg->priority] = msg;
+        dueTail[msg->priority] = msg;
+        break;
       }
+      case TIMER_RENEW:
+        this->renewSubscription((SubscribedFunc*)timer->owner);
+        break;
+      case TIMER_WATCH:
+        this->checkWatchedVariable((VariableWatch*)timer->owner, json);
+        this->timers.schedule(timer, now + UBSUB_WATCH_CHECK_FREQ * 1000);
+        break;
+      #if !(ARDUINO || PARTICLE)
+      case TIMER_PERSIST:
+        this->persist.sync();
+        this->replayPersisted();
+        break;
+      #endif
+      case TIMER_TIME_SYNC:
+        if (this->autoSyncTime)
+          this->syncTime();
+        break;
+      case TIMER_PING:
+        // If we don't have any subs, no reason to constantly ping, as it's mostly for NAT negotiation
+        this->ping();
+        this->timers.schedule(timer, now + UBSUB_PING_FREQ * 1000);
+
+        if (this->lastPong > 0 && now - this->lastPong > UBSUB_CONNECTION_TIMEOUT * 1000) {
+          US_LOG_WARN("Haven't received pong.. lost connection?");
+          reconnect = true;
+        }
+        break;
     }
+  }
 
-    msg = msg->next;
+  for (int i=0; i<UBSUB_PRIORITY_CLASSES; ++i) {
+    QueuedMessage* msg = dueHead[i];
+    while (msg != NULL) {
+      QueuedMessage* next = msg->dueNext;
+      // Delivery callbacks of earlier ones can publish, and shed or recycle a slot still on this list
+      if (this->queueIndex.get(msg->cancelNonce) == msg - this->queueSlots && !this->timers.pending(&msg->timer))
+        this->retryMessage(msg);
+      msg = next;
+    }
   }
+
+  if (json.items() > 0) {
+    json.close();
+    if (strlen(this->watchTopic) > 0)
+      this->callFunction(this->watchTopic, json.c_str());
+    else
+      this->callFunction("watches", json.c_str());
+  }
+
+  this->endBatch();
+
+  // Outside of the batch, since connect() needs its pings sent right away
+  if (reconnect) {
+    // Attempt reconnection
+    this->invalidateSubscriptions();
+    this->connect();
+  }
+  this->processingDepth--;
 }
 
-void Ubsub::writeNonce(const uint64_t &nonce) {
-  this->rrnonce[this->lastNonceIdx] = nonce;
-  this->lastNonceIdx = (this->lastNonceIdx + 1) % UBSUB_NONCE_RR_COUNT;
+// Drops the oldest queued bulk message. Returns false if there are none
+bool Ubsub::shedQueue() {
+  QueuedMessage* msg = this->queueHead[UBSUB_PRIORITY_BULK];
+  if (msg == NULL)
+    return false;
+
+  US_LOG_WARN("Queue full, dropping bulk message 0x%s", tohexstr(msg->cancelNonce));
+  this->stats.shedMessages++;
+  this->completeMessage(msg, UBSUB_ERR_QUEUE_FULL);
+  return true;
+}
+
+void Ubsub::supersedeMessage(QueuedMessage* msg) {
+  US_LOG_DEBUG("Superseding queued message 0x%s", tohexstr(msg->cancelNonce));
+  this->stats.supersededMessages++;
+  this->completeMessage(msg, UBSUB_ERR_SUPERSEDED);
+}
+
+// Removes the message and lets the publisher know how it went. The callback runs last,
+// so it's free to publish again
+void Ubsub::completeMessage(QueuedMessage* msg, int status) {
+  const DeliveryCallback onDelivery = msg->onDelivery;
+  void* const userData = msg->userData;
+  const uint64_t nonce = msg->cancelNonce;
+
+  this->removeQueue(msg);
+
+  if (onDelivery == NULL)
+    return;
+  if (this->deliveryHolds > 0 && this->heldDeliveryCount < UBSUB_HELD_DELIVERIES) {
+    HeldDelivery &held = this->heldDeliveries[this->heldDeliveryCount++];
+    held.onDelivery = onDelivery;
+    held.userData = userData;
+    held.handle = nonce;
+    held.status = status;
+    return;
+  }
+  onDelivery(nonce, status, userData);
+}
+
+// While held, delivery callbacks wait until releaseDeliveries(). Used while a message is being
+// queued, since a callback that publishes would take the slot and packet buffer in use
+void Ubsub::holdDeliveries() {
+  this->deliveryHolds++;
+}
+
+void Ubsub::releaseDeliveries() {
+  if (--this->deliveryHolds > 0)
+    return;
+
+  // Callbacks may publish, and hold (and release) more of their own. Like any other callback,
+  // they count as processing, so a publish from them won't block for the window
+  while (this->heldDeliveryCount > 0 && this->deliveryHolds == 0) {
+    const HeldDelivery held = this->heldDeliveries[0];
+    this->heldDeliveryCount--;
+    memmove(this->heldDeliveries, this->heldDeliveries + 1, sizeof(HeldDelivery) * this->heldDeliveryCount);
+    this->processingDepth++;
+    held.onDelivery(held.handle, held.status, held.userData);
+    this->processingDepth--;
+  }
 }
 
-bool Ubsub::hasNonce(const uint64_t &nonce) {
-  for (int i=0; i<UBSUB_NONCE_RR_COUNT; ++i) {
-    if (this->rrnonce[i] == nonce)
+void Ubsub::retryMessage(QueuedMessage* msg) {
+  // Checked first, so stale messages cost no crypto or airtime
+  const uint64_t now = getTimeMillis();
+  if (msg->expires > 0 && now >= msg->expires) {
+    US_LOG_INFO("Message 0x%s expired, dropping", tohexstr(msg->cancelNonce));
+    this->stats.expiredMessages++;
+    this->completeMessage(msg, UBSUB_ERR_EXPIRED);
+    return;
+  }
+
+  // The last retry has had its chance to be acked too
+  if (msg->retryNumber >= UBSUB_PACKET_RETRY_ATTEMPTS) {
+    US_LOG_WARN("Retried max times, timing out 0x%s", tohexstr(msg->cancelNonce));
+    this->completeMessage(msg, UBSUB_ERR_TIMEOUT);
+    return;
+  }
+
+  US_LOG_INFO("Retrying message 0x%s", tohexstr(msg->cancelNonce));
+  msg->retryNumber++;
+  this->stats.retransmits++;
+
+  // Backoff can outlast the router's timestamp window, so refresh stale packets before resending
+  const uint64_t wallNow = getTime();
+  if (wallNow - msg->stampTime >= UBSUB_PACKET_TIMEOUT / 2) {
+    restampPacket(msg->buf, msg->bufLen, this->deviceKey, this->expandedKey, wallNow);
+    msg->stampTime = wallNow;
+  }
+
+  this->sendData(msg->buf, msg->bufLen);
+
+  // Wake up at expiry rather than the next retry, so the slot is freed promptly
+  uint64_t next = now + this->retryDelay(msg->retryNumber);
+  if (msg->expires > 0 && msg->expires < next)
+    next = msg->expires;
+  this->timers.schedule(&msg->timer, next);
+}
+
+// A queued message the new one will supersede (by coalesceKey, if not 0) doesn't count
+bool Ubsub::sendWindowOpen(int bytes, uint8_t priority, uint64_t coalesceKey) {
+  int queueCount = this->queueCount;
+  int queueBytes = this->queueBytes;
+  const int replaced = coalesceKey != 0 ? this->coalesceIndex.get(coalesceKey) : -1;
+  if (replaced >= 0) {
+    queueCount--;
+    queueBytes -= this->queueSlots[replaced].bufLen;
+  }
+
+  // Bulk is kept out of the top of the window so alarms can still get through
+  const int percent = priority >= UBSUB_PRIORITY_BULK ? UBSUB_BULK_WINDOW_PERCENT : 100;
+  if (this->sendWindowMessages > 0 && queueCount * 100 >= this->sendWindowMessages * percent)
+    return false;
+  // A single message larger than the byte window is still let through once the window drains
+  if (this->sendWindowBytes > 0 && queueCount > 0 && (queueBytes + bytes) * 100 > this->sendWindowBytes * percent)
+    return false;
+  return true;
+}
+
+bool Ubsub::waitForSendWindow(int bytes, uint8_t priority, uint64_t coalesceKey) {
+  if (this->sendWindowOpen(bytes, priority, coalesceKey))
+    return true;
+  if (this->sendWindowBlockMillis <= 0)
+    return false;
+
+  // Publishing from a handler or callback: the receive buffer, the event and the timers in use
+  // by the caller would be overwritten if we processed events here, so fail straight away
+  if (this->processingDepth > 0) {
+    US_LOG_DEBUG("Send window full while processing events, not waiting");
+    return false;
+  }
+
+  // Acks (and retries timing out) are what open the window
+  const uint64_t timeoutTime = getTimeMillis() + this->sendWindowBlockMillis;
+  while (getTimeMillis() < timeoutTime) {
+    this->processEvents();
+    if (this->sendWindowOpen(bytes, priority, coalesceKey))
       return true;
+    #if ARDUINO || PARTICLE
+    delay(1); // Yield to device
+    #endif
   }
   return false;
 }
 
+// After an outage every queued retry is due at once. Spread them, oldest first, over one RTO
+// rather than flooding the router as soon as it answers again
+void Ubsub::replayQueue() {
+  if (this->queueCount == 0)
+    return;
+
+  // Highest class first
+  const uint64_t now = getTimeMillis();
+  int i = 0;
+  for (int c=0; c<UBSUB_PRIORITY_CLASSES; ++c) {
+    for (QueuedMessage* msg = this->queueHead[c]; msg != NULL; msg = msg->next, ++i)
+      this->timers.schedule(&msg->timer, now + (uint64_t)this->rto * i / this->queueCount);
+  }
+
+  US_LOG_INFO("Replaying %d queued messages", this->queueCount);
+}
+
+// Moves messages recovered from the persistent queue back into the retry queue, as slots allow
+void Ubsub::replayPersisted() {
+  #if !(ARDUINO || PARTICLE)
+  if (this->persistReplayDone || !this->socketInit)
+    return;
+
+  int count = 0;
+  while (this->queueFree != NULL) {
+    const int64_t ref = this->persist.nextRecovered(this->persistReplayRef);
+    if (ref < 0) {
+      this->persistReplayDone = true;
+      break;
+    }
+    this->persistReplayRef = ref;
+
+    int len = 0;
+    uint64_t nonce = 0;
+    uint8_t priority = 0;
+    const uint8_t* packet = this->persist.get(ref, &len, &nonce, &priority);
+    if (packet == NULL || len > UBSUB_MTU || priority >= UBSUB_PRIORITY_CLASSES || this->queueIndex.get(nonce) >= 0) {
+      // Never going to be sent, so don't let it keep its segment around
+      US_LOG_WARN("Skipping unusable persisted message 0x%s", tohexstr(nonce));
+      this->persist.ack(ref);
+      continue;
+    }
+
+    QueuedMessage* msg = this->queueMessage(packet, len, nonce, priority);
+    msg->persistRef = ref;
+    msg->stampTime = 0; // Stamped in a previous run, re-stamp before resending
+    msg->retryNumber = 1; // Was sent before the restart, so acks don't give an RTT sample
+    count++;
+  }
+
+  if (count > 0)
+    US_LOG_INFO("Recovered %d messages from persistent queue", count);
+
+  // Rest waits for slots to free up
+  if (!this->persistReplayDone && !this->timers.pending(&this->persistTimer))
+    this->timers.schedule(&this->persistTimer, getTimeMillis() + UBSUB_PERSIST_SYNC_MILLIS);
+  #endif
+}
+
+void Ubsub::sampleRtt(uint32_t rttMillis) {
+  if (this->srtt == 0) {
+    this->srtt = rttMillis > 0 ? rttMillis : 1;
+    this->rttvar = rttMillis / 2;
+  } else {
+    const uint32_t delta = this->srtt > rttMillis ? this->srtt - rttMillis : rttMillis - this->srtt;
+    this->rttvar = (3 * this->rttvar + delta) / 4;
+    this->srtt = (7 * this->srtt + rttMillis) / 8;
+    if (this->srtt == 0)
+      this->srtt = 1;
+  }
+
+  uint32_t rto = this->srtt + (4 * this->rttvar > 1 ? 4 * this->rttvar : 1);
+  if (rto < UBSUB_RTO_MIN_MILLIS)
+    rto = UBSUB_RTO_MIN_MILLIS;
+  if (rto > UBSUB_RTO_MAX_MILLIS)
+    rto = UBSUB_RTO_MAX_MILLIS;
+  this->rto = rto;
+
+  this->stats.rttSamples++;
+  this->stats.srttMillis = this->srtt;
+  this->stats.rttvarMillis = this->rttvar;
+  this->stats.rtoMillis = this->rto;
+}
+
+// Exponential backoff from the current RTO with +/-25% jitter, so retries from many devices don't line up
+uint32_t Ubsub::retryDelay(int retryNumber) {
+  uint32_t delay = this->rto;
+  for (int i=0; i<retryNumber && delay < UBSUB_RTO_MAX_MILLIS; ++i)
+    delay *= 2;
+  if (delay > UBSUB_RTO_MAX_MILLIS)
+    delay = UBSUB_RTO_MAX_MILLIS;
+  return delay - delay / 4 + getNonce32() % (delay / 2 + 1);
+}
+
 void Ubsub::ping() {
   uint8_t buf[2];
   write_le<uint16_t>(buf+0, this->localPort);
-  this->sendCommand(CMD_PING, 0x0, false, buf, 2);
+
+  #if !(ARDUINO || PARTICLE)
+  if (this->routerAddrIdx < 0 && this->socketInit) {
+    // Racing: the same ping goes to every address at once
+    static uint8_t packet[UBSUB_MTU];
+    int plen = createPacket(packet, UBSUB_MTU, this->deviceId, this->deviceKey, this->expandedKey, CMD_PING, PING_FLAG_MULTI_ACK | PING_FLAG_BATCH_SUB_ACK | PING_FLAG_PATTERN_ONCE, getNonce64(), buf, 2, NULL, 0);
+    if (plen < 0) {
+      this->setError(UBSUB_ERR_SEND);
+      return;
+    }
+    for (int i=0; i<this->routerAddrCount; ++i) {
+      if (sendto(this->sock, packet, plen, 0, (sockaddr*)&this->routerAddrs[i], this->routerAddrLens[i]) == plen)
+        this->stats.packetsSent++;
+    }
+    return;
+  }
+  #endif
+
+  this->sendCommand(CMD_PING, PING_FLAG_MULTI_ACK | PING_FLAG_BATCH_SUB_ACK | PING_FLAG_PATTERN_ONCE, false, buf, 2);
 }
 
 SubscribedFunc* Ubsub::getSubscribedFuncByNonce(const uint64_t &nonce) {
-  SubscribedFunc* sub = this->subs;
-  while (sub != NULL) {
-    if (sub->requestNonce == nonce)
-      return sub;
-    sub = sub->next;
-  }
-  return NULL;
+  const int idx = this->subsByNonce.get(nonce);
+  return idx >= 0 ? &this->subs[idx] : NULL;
 }
 
 SubscribedFunc* Ubsub::getSubscribedFuncByFuncId(const uint64_t &funcId) {
-  SubscribedFunc* sub = this->subs;
-  while (sub != NULL) {
-    if (sub->funcId == funcId)
-      return sub;
-    sub = sub->next;
+  const int idx = this->subsByFuncId.get(funcId);
+  return idx >= 0 ? &this->subs[idx] : NULL;
+}
+
+bool Ubsub::growSubscriptions() {
+  const int oldCapacity = this->subCapacity;
+  const int capacity = oldCapacity > 0 ? oldCapacity * 2 : UBSUB_SUBSCRIPTION_CAPACITY;
+  SubscribedFunc* subs = (SubscribedFunc*)malloc(sizeof(SubscribedFunc) * capacity);
+  if (subs == NULL)
+    return false;
+  if (!this->indexSubscriptions(capacity)) {
+    free(subs);
+    this->indexSubscriptions(oldCapacity);
+    return false;
+  }
+
+  // Renewal timers are linked into the wheel by address, so move them with the table
+  for (int i=0; i<this->subCount; ++i) {
+    TimerNode* oldTimer = &this->subs[i].renewTimer;
+    const bool pending = this->timers.pending(oldTimer);
+    const uint64_t expires = oldTimer->expires;
+    this->timers.cancel(oldTimer);
+
+    subs[i] = this->subs[i];
+    initTimer(&subs[i].renewTimer, TIMER_RENEW, &subs[i]);
+    if (pending)
+      this->timers.schedule(&subs[i].renewTimer, expires);
+  }
+
+  if (this->dispatching && this->retiredSubs == NULL)
+    this->retiredSubs = this->subs;
+  else
+    free(this->subs);
+  this->subs = subs;
+  this->subCapacity = capacity;
+  return true;
+}
+
+bool Ubsub::indexSubscriptions(int capacity) {
+  if (!this->subsByFuncId.init(capacity) || !this->subsByNonce.init(capacity) || !this->subsByTopic.init(capacity))
+    return false;
+  for (int i=0; i<this->subCount; ++i) {
+    this->subsByFuncId.put(this->subs[i].funcId, i);
+    this->subsByTopic.put(this->subs[i].topicHash, i);
+    if (this->subs[i].requestNonce != 0)
+      this->subsByNonce.put(this->subs[i].requestNonce, i);
   }
-  return NULL;
+  return true;
 }
 
 void Ubsub::invalidateSubscriptions() {
-  SubscribedFunc *sub = this->subs;
-  while (sub != NULL) {
+  uint64_t now = getTimeMillis();
+  for (int i=0; i<this->subCount; ++i) {
+    SubscribedFunc *sub = &this->subs[i];
     sub->renewTime = 0;
-    sub = sub->next;
+    this->timers.schedule(&sub->renewTimer, now);
   }
 }
 
-void Ubsub::renewSubscriptions() {
-  uint64_t now = getTime();
-  SubscribedFunc *sub = this->subs;
-  while (sub != NULL) {
-    if (now >= sub->renewTime) {
-      // Renew
-      US_LOG_INFO("Renewing subscription to %s...", sub->topicNameOrId);
-
-      sub->requestNonce = getNonce64();
-      sub->renewTime = now + 5;
-
-      const int COMMAND_LEN = 44;
-      uint8_t command[COMMAND_LEN];
-      memset(command, 0, COMMAND_LEN);
-
-      write_le<uint16_t>(command+0, this->localPort);
-      pushstr(command+2, sub->topicNameOrId, 32);
-      write_le<uint64_t>(command+34, sub->funcId);
-      write_le<uint16_t>(command+42, UBSUB_SUBSCRIPTION_TTL);
-
-      this->sendCommand(
-        CMD_SUB,
-        SUB_FLAG_ACK | SUB_FLAG_UNWRAP | SUB_FLAG_MSG_NEED_ACK,
-        this->autoRetry,
-        sub->requestNonce,
-        command,
-        COMMAND_LEN,
-        NULL, 0);
-    }
-    sub = sub->next;
+void Ubsub::renewSubscription(SubscribedFunc* sub) {
+  US_LOG_INFO("Renewing subscription to %s...", sub->topicNameOrId);
+
+  if (sub->requestNonce != 0)
+    this->subsByNonce.remove(sub->requestNonce);
+  sub->requestNonce = getNonce64();
+  this->subsByNonce.put(sub->requestNonce, sub - this->subs);
+  this->timers.schedule(&sub->renewTimer, getTimeMillis() + 5000);
+
+  const int COMMAND_LEN = 44;
+  uint8_t command[COMMAND_LEN];
+  memset(command, 0, COMMAND_LEN);
+
+  write_le<uint16_t>(command+0, this->localPort);
+  // A plain topic is renewed by its id, a pattern has to be matched again
+  pushstr(command+2, sub->pattern || sub->topicId[0] == '\0' ? sub->topicNameOrId : sub->topicId, 32);
+  write_le<uint64_t>(command+34, sub->funcId);
+  write_le<uint16_t>(command+42, UBSUB_SUBSCRIPTION_TTL);
+
+  this->sendCommand(
+    CMD_SUB,
+    SUB_FLAG_ACK | SUB_FLAG_UNWRAP | SUB_FLAG_MSG_NEED_ACK | (sub->pattern ? SUB_FLAG_PATTERN : 0),
+    this->autoRetry,
+    sub->requestNonce,
+    command,
+    COMMAND_LEN,
+    NULL, 0);
+}
+
+// FNV-1a, never 0 so 0 can mean "none"
+static uint64_t hash64(const uint8_t* data, int len) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (int i=0; i<len; ++i) {
+    hash ^= data[i];
+    hash *= 0x100000001b3ULL;
   }
+  return hash != 0 ? hash : 1;
 }
 
 static uint32_t hash32(const uint8_t* data, int len) {
@@ -731,63 +1729,48 @@ static uint32_t hash32(const uint8_t* data, int len) {
   return hash;
 }
 
-void Ubsub::checkWatchedVariables() {
-  uint64_t now = getTime();
-  
-  char buf[128]; // stack buffer
-  MiniJsonBuilder json(buf, sizeof(buf));
-  json.open();
-
-  VariableWatch *watch = this->watch;
-  while(watch != NULL) {
-    if (now >= watch->lastCheck + UBSUB_WATCH_CHECK_FREQ) {
-      watch->lastCheck = now;
-
-      // Compute hash
-      uint32_t hash = hash32(watch->ptr, watch->len);
-      if (hash != watch->hash) {
-        // There was an update!
-        US_LOG_INFO("Detected change in variable %s, updating...", watch->name);
-        watch->hash = hash;
-
-        if (watch->format == FORMAT_STRING) {
-          json.write(watch->name, (char*)watch->ptr);
-        } else if (watch->format == FORMAT_INT) {
-          json.write(watch->name, *(int*)watch->ptr);
-        } else if (watch->format == FORMAT_FLOAT) {
-          json.write(watch->name, *(float*)watch->ptr);
-        } else {
-          US_LOG_WARN("Unable to send watched variable, unknown variable %d", watch->format);
-        }
-      }
-    }
-
-    watch = watch->next;
-  }
-
-  if (json.items() > 0) {
-    json.close();
-    if (strlen(this->watchTopic) > 0)
-      this->callFunction(this->watchTopic, json.c_str());
-    else
-      this->callFunction("watches", json.c_str());
+// Adds the variable to json if it changed since it was last checked
+bool Ubsub::checkWatchedVariable(VariableWatch* watch, MiniJsonBuilder &json) {
+  // Compute hash
+  uint32_t hash = hash32(watch->ptr, watch->len);
+  if (hash == watch->hash)
+    return false;
+
+  // There was an update!
+  US_LOG_INFO("Detected change in variable %s, updating...", watch->name);
+  watch->hash = hash;
+
+  if (watch->format == FORMAT_STRING) {
+    json.write(watch->name, (char*)watch->ptr);
+  } else if (watch->format == FORMAT_INT) {
+    json.write(watch->name, *(int*)watch->ptr);
+  } else if (watch->format == FORMAT_FLOAT) {
+    json.write(watch->name, *(float*)watch->ptr);
+  } else {
+    US_LOG_WARN("Unable to send watched variable, unknown variable %d", watch->format);
+    return false;
   }
+  return true;
 }
 
 
-int Ubsub::sendCommand(uint16_t cmd, uint8_t flag, bool retry, const uint64_t &nonce, const uint8_t *command, int commandLen, const uint8_t* optData, int dataLen) {
+int Ubsub::sendCommand(uint16_t cmd, uint8_t flag, bool retry, const uint64_t &nonce, const uint8_t *command, int commandLen, const uint8_t* optData, int dataLen, uint8_t priority) {
   static uint8_t buf[UBSUB_MTU];
-  int plen = createPacket(buf, UBSUB_MTU, this->deviceId, this->deviceKey, cmd, flag, nonce, command, commandLen, optData, dataLen);
+  int plen = createPacket(buf, UBSUB_MTU, this->deviceId, this->deviceKey, this->expandedKey, cmd, flag, nonce, command, commandLen, optData, dataLen);
   if (plen < 0) {
     this->setError(UBSUB_ERR_SEND);
     return -1;
   }
 
-  if (retry) {
-    this->queueMessage(buf, plen, nonce);
-  }
-
-  return this->sendData(buf, plen);
+  // Messages shed to make room are told once buf is sent, in case their callbacks publish
+  this->holdDeliveries();
+  int ret;
+  if (retry && this->queueMessage(buf, plen, nonce, priority, cmd == CMD_MSG) == NULL)
+    ret = UBSUB_ERR_QUEUE_FULL;
+  else
+    ret = this->sendData(buf, plen);
+  this->releaseDeliveries();
+  return ret;
 }
 
 int Ubsub::sendCommand(uint16_t cmd, uint8_t flag, bool retry, const uint8_t *command, int commandLen) {
@@ -808,37 +1791,171 @@ int Ubsub::receiveData() {
     return 0;
   }
 
+  #if ARDUINO || PARTICLE
   static uint8_t buf[UBSUB_MTU];
+  #else
+  static uint8_t buf[UBSUB_RECV_BUFFER_LEN];
+  #endif
   int received = 0;
+  int datagrams = 0; // Read, whether processed or dropped, for the budget
+  this->recvPending = false;
+  this->processingDepth++;
 
   while (true) {
+    // Leave the rest for the next call, so the application gets a turn
+    if (this->recvBudget > 0 && datagrams >= this->recvBudget) {
+      this->recvPending = true;
+      this->stats.recvBudgetHits++;
+      break;
+    }
+
     int rlen = -1;
+    int segLen = 0; // Size of each datagram if the kernel coalesced several (GRO)
 
+    // Anything that didn't come from the router is dropped here, before it
+    // can cost us a signature check
     #if ARDUINO
       if (this->sock.parsePacket() > 0) {
+        if (this->sock.remotePort() != this->port) {
+          this->stats.foreignDrops++;
+          datagrams++;
+          continue;
+        }
         rlen = this->sock.read(buf, UBSUB_MTU);
       }
     #elif PARTICLE
       if (this->sock.parsePacket() > 0) {
+        if (this->sock.remotePort() != this->port) {
+          this->stats.foreignDrops++;
+          datagrams++;
+          continue;
+        }
         rlen = this->sock.read(buf, UBSUB_MTU);
       }
     #else
-      struct sockaddr_in from;
-      socklen_t fromlen = 0;
-      rlen = recvfrom(this->sock, buf, UBSUB_MTU, 0x0, (struct sockaddr*)&from, &fromlen);
+      struct sockaddr_storage from;
+      struct timespec arrival; // Kernel receive time, for latency stats
+      arrival.tv_sec = 0;
+      struct iovec iov;
+      iov.iov_base = buf;
+      iov.iov_len = sizeof(buf);
+
+      uint8_t control[128];
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_name = &from;
+      msg.msg_namelen = sizeof(from);
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+
+      rlen = recvmsg(this->sock, &msg, 0);
+
+      if (rlen >= 0) {
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+          #ifdef SCM_TIMESTAMPNS
+          if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy(&arrival, CMSG_DATA(cmsg), sizeof(arrival));
+          }
+          #endif
+          #ifdef UBSUB_HAVE_UDP_OFFLOAD
+          if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+            memcpy(&segLen, CMSG_DATA(cmsg), sizeof(int));
+          }
+          #endif
+          #ifdef SO_RXQ_OVFL
+          if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+            // Cumulative count for the socket; accumulate the delta so reconnects don't reset it
+            uint32_t drops;
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+            if (drops != this->lastKernelDrops) {
+              US_LOG_WARN("Kernel dropped %u packets, receive buffer too small?", drops - this->lastKernelDrops);
+              this->stats.kernelDrops += drops - this->lastKernelDrops;
+              this->lastKernelDrops = drops;
+            }
+          }
+          #endif
+        }
+
+        this->recvAddrIdx = this->findRouterAddr(from, msg.msg_namelen);
+        if (this->recvAddrIdx < 0) {
+          US_LOG_DEBUG("Dropping %d bytes from foreign address", rlen);
+          this->stats.foreignDrops++;
+          datagrams++;
+          continue;
+        }
+      }
     #endif
 
     if (rlen < 0)
       break;
+    if (segLen <= 0)
+      segLen = rlen;
+    const int segments = rlen > 0 ? (rlen + segLen - 1) / segLen : 1; // An empty datagram is still one
+    datagrams += segments;
+
+    // Split a coalesced burst back into its datagrams; only the last may be short
+    for (int off = 0; off < rlen; off += segLen) {
+      int len = min(segLen, rlen - off);
+      if (len > UBSUB_MTU) {
+        this->setError(UBSUB_ERR_EXCEEDS_MTU);
+        continue;
+      }
+      this->processPacket(buf + off, len);
+      this->stats.packetsReceived++;
+      received++;
+    }
 
-    this->processPacket(buf, rlen);
-
-    received++;
+    #if !(ARDUINO || PARTICLE)
+    if (arrival.tv_sec != 0) {
+      struct timespec done;
+      clock_gettime(CLOCK_REALTIME, &done);
+      int64_t micros = (int64_t)(done.tv_sec - arrival.tv_sec) * 1000000L + (done.tv_nsec - arrival.tv_nsec) / 1000;
+      if (micros >= 0) {
+        const uint32_t sample = micros > 0xFFFFFFFFL ? 0xFFFFFFFF : (uint32_t)micros;
+        this->latencyBuckets[latencyBucket(sample)] += segments;
+        this->stats.latencySamples += segments;
+        if (sample > this->stats.latencyMaxMicros)
+          this->stats.latencyMaxMicros = sample;
+      }
+    }
+    #endif
   }
 
+  // Events acked during this drain go out together
+  this->flushEventAcks();
+
+  this->processingDepth--;
   return received;
 }
 
+// Acks an accepted event. If the router takes batched acks, they're held until the end of
+// the receive drain, a packet's worth has built up, or an inline handler is about to run after
+// the oldest has waited UBSUB_SUB_ACK_DELAY_MILLIS
+void Ubsub::ackEvent(const uint64_t &nonce) {
+  if (!this->batchSubAcks) {
+    uint8_t msgAck[8];
+    write_le(msgAck, nonce);
+    this->sendCommand(CMD_SUB_MSG_ACK, 0x0, false, msgAck, sizeof(msgAck));
+    return;
+  }
+
+  if (this->subAckCount == 0)
+    this->subAckSince = getTimeMillis();
+  write_le(this->subAcks + this->subAckCount * 8, nonce);
+  if (++this->subAckCount == UBSUB_SUB_ACK_BATCH)
+    this->flushEventAcks();
+}
+
+void Ubsub::flushEventAcks() {
+  if (this->subAckCount == 0)
+    return;
+  US_LOG_DEBUG("Acking %d events", this->subAckCount);
+  this->sendCommand(CMD_SUB_MSG_ACK, 0x0, false, this->subAcks, this->subAckCount * 8);
+  this->subAckCount = 0;
+}
+
 int Ubsub::sendData(const uint8_t* buf, int bufSize) {
   if (bufSize > UBSUB_MTU) {
     this->setError(UBSUB_ERR_EXCEEDS_MTU);
@@ -849,6 +1966,92 @@ int Ubsub::sendData(const uint8_t* buf, int bufSize) {
     return -1;
   }
 
+  #if !(ARDUINO || PARTICLE)
+  if (this->batchDepth > 0) {
+    // GSO requires equal segment sizes, so a change in size starts a new batch
+    if (this->batchCount > 0 && (bufSize != this->batchSegLen || this->batchCount >= UBSUB_BATCH_MAX_PACKETS)) {
+      this->flushBatch();
+    }
+    if (this->batchCount == 0) {
+      this->batchSegLen = bufSize;
+    }
+    memcpy(this->batchBuf + this->batchLen, buf, bufSize);
+    this->batchLen += bufSize;
+    this->batchCount++;
+    return bufSize;
+  }
+  #endif
+
+  return this->sendDataNow(buf, bufSize);
+}
+
+// Sends any packets held back by beginBatch(). Returns number of packets sent
+int Ubsub::flushBatch() {
+  #if ARDUINO || PARTICLE
+    return 0;
+  #else
+    const int count = this->batchCount;
+    const int segLen = this->batchSegLen;
+    this->batchCount = 0;
+    this->batchLen = 0;
+
+    if (count == 0)
+      return 0;
+
+    #ifdef UBSUB_HAVE_UDP_OFFLOAD
+    if (count > 1 && this->gsoSupported && (this->routerAddrCount > 0 || this->resolveRouter())) {
+      US_LOG_DEBUG("Sending %d packets of %d bytes to host %s:%d as one segmented send...", count, segLen, this->host, this->port);
+
+      struct iovec iov;
+      iov.iov_base = this->batchBuf;
+      iov.iov_len = count * segLen;
+
+      uint8_t control[CMSG_SPACE(sizeof(uint16_t))];
+      memset(control, 0, sizeof(control));
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      const int addrIdx = this->routerAddrIdx < 0 ? 0 : this->routerAddrIdx;
+      msg.msg_name = &this->routerAddrs[addrIdx];
+      msg.msg_namelen = this->routerAddrLens[addrIdx];
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = IPPROTO_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      uint16_t gsoSize = segLen;
+      memcpy(CMSG_DATA(cmsg), &gsoSize, sizeof(gsoSize));
+
+      int ret = sendmsg(this->sock, &msg, 0);
+      if (ret == count * segLen) {
+        this->stats.packetsSent += count;
+        return count;
+      }
+
+      if (ret < 0 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+        // Route or device can't segment; stop trying and send individually from now on
+        US_LOG_WARN("Segmented send rejected (errno %d), falling back to single sends", errno);
+        this->gsoSupported = false;
+      } else {
+        this->setError(UBSUB_ERR_SEND);
+        return -1;
+      }
+    }
+    #endif
+
+    int sent = 0;
+    for (int i=0; i<count; ++i) {
+      if (this->sendDataNow(this->batchBuf + i*segLen, segLen) == segLen)
+        sent++;
+    }
+    return sent;
+  #endif
+}
+
+int Ubsub::sendDataNow(const uint8_t* buf, int bufSize) {
   US_LOG_DEBUG("Sending %d bytes to host %s:%d...", bufSize, this->host, this->port);
 
   #if ARDUINO
@@ -858,30 +2061,25 @@ int Ubsub::sendData(const uint8_t* buf, int bufSize) {
       return -1;
     if (this->sock.endPacket() != 1)
       return -1;
+    this->stats.packetsSent++;
     return bufSize;
   #elif PARTICLE
     this->sock.beginPacket(this->host, this->port);
     this->sock.write(buf, bufSize);
+    this->stats.packetsSent++;
     return this->sock.endPacket();
   #else
-    struct hostent *server;
-    server = gethostbyname(this->host);
-    if (server == NULL) {
-      US_LOG_WARN("Failed to resolve hostname %s. Connected?", this->host);
+    if (this->routerAddrCount == 0 && !this->resolveRouter()) {
       return -1;
     }
 
-    struct sockaddr_in serveraddr;
-    bzero((char*)&serveraddr, sizeof(serveraddr));
-    serveraddr.sin_family = AF_INET;
-    bcopy((char*)server->h_addr, (char*)&serveraddr.sin_addr.s_addr, server->h_length);
-    serveraddr.sin_port = htons(this->port);
-
-    int ret = sendto(this->sock, buf, bufSize, 0, (sockaddr*)&serveraddr, sizeof(serveraddr));
+    const int addrIdx = this->routerAddrIdx < 0 ? 0 : this->routerAddrIdx;
+    int ret = sendto(this->sock, buf, bufSize, 0, (sockaddr*)&this->routerAddrs[addrIdx], this->routerAddrLens[addrIdx]);
     if (ret != bufSize) {
       this->setError(UBSUB_ERR_SEND);
       return -1;
     }
+    this->stats.packetsSent++;
     return ret;
   #endif
 }
@@ -896,19 +2094,44 @@ void Ubsub::initSocket() {
     this->sock.begin(this->localPort);
     this->sock.setBuffer(UBSUB_MTU);
   #else
-    this->sock = socket(AF_INET, SOCK_DGRAM, 0);
+    // Prefer a dual-stack socket so the router can be reached over IPv4 or IPv6
+    this->sockFamily = AF_INET6;
+    this->sock = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (this->sock >= 0) {
+      int v6only = 0;
+      if (setsockopt(this->sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0) {
+        close(this->sock);
+        this->sock = -1;
+      }
+    }
+    if (this->sock < 0) {
+      US_LOG_DEBUG("IPv6 unavailable, using IPv4 socket");
+      this->sockFamily = AF_INET;
+      this->sock = socket(AF_INET, SOCK_DGRAM, 0);
+    }
     if (this->sock < 0) {
       this->setError(UBSUB_ERR_SOCKET);
       return;
     }
 
-    struct sockaddr_in bindAddr;
+    struct sockaddr_storage bindAddr;
+    socklen_t bindLen;
     memset((char*)&bindAddr, 0, sizeof(bindAddr));
-    bindAddr.sin_family = AF_INET;
-    bindAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    bindAddr.sin_port = htons(this->localPort);
+    if (this->sockFamily == AF_INET6) {
+      struct sockaddr_in6* addr = (struct sockaddr_in6*)&bindAddr;
+      addr->sin6_family = AF_INET6;
+      addr->sin6_addr = in6addr_any;
+      addr->sin6_port = htons(this->localPort);
+      bindLen = sizeof(struct sockaddr_in6);
+    } else {
+      struct sockaddr_in* addr = (struct sockaddr_in*)&bindAddr;
+      addr->sin_family = AF_INET;
+      addr->sin_addr.s_addr = htonl(INADDR_ANY);
+      addr->sin_port = htons(this->localPort);
+      bindLen = sizeof(struct sockaddr_in);
+    }
 
-    if (bind(this->sock, (struct sockaddr*)&bindAddr, sizeof(bindAddr)) < 0) {
+    if (bind(this->sock, (struct sockaddr*)&bindAddr, bindLen) < 0) {
       this->setError(UBSUB_ERR_SOCKET_BIND);
       this->closeSocket();
       return;
@@ -919,11 +2142,144 @@ void Ubsub::initSocket() {
       this->closeSocket();
       return;
     }
+
+    #ifdef UBSUB_HAVE_UDP_OFFLOAD
+    // Probe for UDP offload support; older kernels reject the options
+    int gsoSize = 0;
+    this->gsoSupported = setsockopt(this->sock, IPPROTO_UDP, UDP_SEGMENT, &gsoSize, sizeof(gsoSize)) == 0;
+    int gro = 1;
+    this->groSupported = setsockopt(this->sock, IPPROTO_UDP, UDP_GRO, &gro, sizeof(gro)) == 0;
+    US_LOG_DEBUG("UDP offload support: gso=%d gro=%d", this->gsoSupported, this->groSupported);
+    #endif
+
+    // Bursts of events can arrive faster than processEvents() is called, so size the
+    // buffers if asked. Failing to set them is not fatal; we report what we actually got
+    if (this->recvBufferBytes > 0 && setsockopt(this->sock, SOL_SOCKET, SO_RCVBUF, &this->recvBufferBytes, sizeof(int)) < 0) {
+      US_LOG_WARN("Unable to set receive buffer to %d bytes", this->recvBufferBytes);
+    }
+    if (this->sendBufferBytes > 0 && setsockopt(this->sock, SOL_SOCKET, SO_SNDBUF, &this->sendBufferBytes, sizeof(int)) < 0) {
+      US_LOG_WARN("Unable to set send buffer to %d bytes", this->sendBufferBytes);
+    }
+    socklen_t optLen = sizeof(int);
+    getsockopt(this->sock, SOL_SOCKET, SO_RCVBUF, &this->stats.recvBufferSize, &optLen);
+    optLen = sizeof(int);
+    getsockopt(this->sock, SOL_SOCKET, SO_SNDBUF, &this->stats.sendBufferSize, &optLen);
+    US_LOG_DEBUG("Socket buffers: recv=%d send=%d", this->stats.recvBufferSize, this->stats.sendBufferSize);
+
+    #ifdef SO_TIMESTAMPNS
+    int timestamps = 1;
+    setsockopt(this->sock, SOL_SOCKET, SO_TIMESTAMPNS, &timestamps, sizeof(timestamps));
+    #endif
+
+    #ifdef SO_RXQ_OVFL
+    int rxqOvfl = 1;
+    this->lastKernelDrops = 0;
+    if (setsockopt(this->sock, SOL_SOCKET, SO_RXQ_OVFL, &rxqOvfl, sizeof(rxqOvfl)) < 0) {
+      US_LOG_WARN("Kernel drop accounting (SO_RXQ_OVFL) not available");
+    }
+    #endif
   #endif
 
   this->socketInit = true;
+  this->applyBusyPoll();
+}
+
+void Ubsub::applyBusyPoll() {
+  #if defined(__linux__) && defined(SO_BUSY_POLL)
+  if (!this->socketInit)
+    return;
+  if (setsockopt(this->sock, SOL_SOCKET, SO_BUSY_POLL, &this->busyPollMicros, sizeof(int)) < 0) {
+    US_LOG_WARN("Unable to set SO_BUSY_POLL (needs CAP_NET_ADMIN above net.core.busy_read)");
+  }
+  #ifdef SO_PREFER_BUSY_POLL
+  int prefer = this->busyPollMicros > 0 ? 1 : 0;
+  if (setsockopt(this->sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) < 0) {
+    US_LOG_DEBUG("SO_PREFER_BUSY_POLL not supported");
+  }
+  #endif
+  #endif
 }
 
+// Resolves the router hostname to the set of addresses we send to and accept packets from
+bool Ubsub::resolveRouter() {
+  #if ARDUINO || PARTICLE
+    return true;
+  #else
+    char portStr[8];
+    snprintf(portStr, sizeof(portStr), "%d", this->port);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = this->sockFamily == AF_INET6 ? AF_UNSPEC : AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    struct addrinfo* res = NULL;
+    if (getaddrinfo(this->host, portStr, &hints, &res) != 0 || res == NULL) {
+      US_LOG_WARN("Failed to resolve hostname %s. Connected?", this->host);
+      return false;
+    }
+
+    int count = 0;
+    for (struct addrinfo* ai = res; ai != NULL && count < UBSUB_MAX_ROUTER_ADDRS; ai = ai->ai_next) {
+      struct sockaddr_storage* addr = &this->routerAddrs[count];
+      memset(addr, 0, sizeof(*addr));
+
+      if (ai->ai_family == AF_INET && this->sockFamily == AF_INET6) {
+        // Dual-stack socket talks to IPv4 hosts through v4-mapped addresses (::ffff:a.b.c.d)
+        const struct sockaddr_in* v4 = (const struct sockaddr_in*)ai->ai_addr;
+        struct sockaddr_in6* v6 = (struct sockaddr_in6*)addr;
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = v4->sin_port;
+        v6->sin6_addr.s6_addr[10] = 0xff;
+        v6->sin6_addr.s6_addr[11] = 0xff;
+        memcpy(&v6->sin6_addr.s6_addr[12], &v4->sin_addr, 4);
+        this->routerAddrLens[count] = sizeof(struct sockaddr_in6);
+      } else if (ai->ai_family == this->sockFamily) {
+        memcpy(addr, ai->ai_addr, ai->ai_addrlen);
+        this->routerAddrLens[count] = ai->ai_addrlen;
+      } else {
+        continue;
+      }
+
+      // getaddrinfo returns one entry per protocol on some platforms; skip repeats
+      bool dupe = false;
+      for (int i=0; i<count && !dupe; ++i) {
+        dupe = this->routerAddrLens[i] == this->routerAddrLens[count] && memcmp(&this->routerAddrs[i], addr, this->routerAddrLens[i]) == 0;
+      }
+      if (!dupe)
+        count++;
+    }
+    freeaddrinfo(res);
+
+    this->routerAddrCount = count;
+    this->routerAddrIdx = 0;
+    US_LOG_DEBUG("Resolved %s to %d address(es)", this->host, count);
+    return count > 0;
+  #endif
+}
+
+#if !(ARDUINO || PARTICLE)
+// Returns the index of the router address the packet came from, or -1 if foreign
+int Ubsub::findRouterAddr(const struct sockaddr_storage &from, socklen_t fromLen) {
+  for (int i=0; i<this->routerAddrCount; ++i) {
+    if (from.ss_family != this->routerAddrs[i].ss_family)
+      continue;
+    if (from.ss_family == AF_INET6) {
+      const struct sockaddr_in6* a = (const struct sockaddr_in6*)&from;
+      const struct sockaddr_in6* b = (const struct sockaddr_in6*)&this->routerAddrs[i];
+      if (fromLen >= sizeof(*a) && a->sin6_port == b->sin6_port && memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) == 0)
+        return i;
+    } else if (from.ss_family == AF_INET) {
+      const struct sockaddr_in* a = (const struct sockaddr_in*)&from;
+      const struct sockaddr_in* b = (const struct sockaddr_in*)&this->routerAddrs[i];
+      if (fromLen >= sizeof(*a) && a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr)
+        return i;
+    }
+  }
+  return -1;
+}
+#endif
+
 void Ubsub::closeSocket() {
   if (this->socketInit) {
     #if ARDUINO
@@ -954,9 +2310,12 @@ void Ubsub::syncTime(int timeout) {
   #endif
 
   this->lastTimeSync = getTime();
+  if (this->autoSyncTime)
+    this->timers.schedule(&this->syncTimer, getTimeMillis() + (uint64_t)UBSUB_TIME_SYNC_FREQ * 1000);
 }
 
-static int createPacket(uint8_t* buf, int bufSize, const char *deviceId, const char *key, uint16_t cmd, uint8_t flag, const uint64_t &nonce,
+// expandedKey is the SHA-256 of key, derived once by the caller
+static int createPacket(uint8_t* buf, int bufSize, const char *deviceId, const char *key, uint8_t *expandedKey, uint16_t cmd, uint8_t flag, const uint64_t &nonce,
     const uint8_t *body, int bodyLen, const uint8_t *optData, int dataLen) {
 
   if (bufSize < UBSUB_CRYPTHEADER_LEN + UBSUB_HEADER_LEN + bodyLen + dataLen + UBSUB_SIGNATURE_LEN) {
@@ -1001,9 +2360,6 @@ static int createPacket(uint8_t* buf, int bufSize, const char *deviceId, const c
   }
 
   // Run the body though the cipher
-  Sha256.init();
-  Sha256.write((uint8_t*)key, strlen(key));
-  uint8_t* expandedKey = Sha256.result();
   s20_crypt(expandedKey, S20_KEYLEN_256, (uint8_t*)&nonce, 0, buf+25, UBSUB_HEADER_LEN + fullDataLength);
 
   // Sign the entire thing
@@ -1015,6 +2371,20 @@ static int createPacket(uint8_t* buf, int bufSize, const char *deviceId, const c
   return UBSUB_CRYPTHEADER_LEN + UBSUB_HEADER_LEN + fullDataLength + UBSUB_SIGNATURE_LEN;
 }
 
+// Rewrites the timestamp of a sealed packet in place: decrypt, update, re-encrypt and re-sign
+static void restampPacket(uint8_t* buf, int len, const char *key, uint8_t *expandedKey, uint64_t ts) {
+  const uint64_t nonce = read_le<uint64_t>(buf+1);
+  const int sealedLen = len - UBSUB_CRYPTHEADER_LEN - UBSUB_SIGNATURE_LEN;
+
+  s20_crypt(expandedKey, S20_KEYLEN_256, (uint8_t*)&nonce, 0, buf+25, sealedLen);
+  write_le<uint64_t>(buf+25, ts);
+  s20_crypt(expandedKey, S20_KEYLEN_256, (uint8_t*)&nonce, 0, buf+25, sealedLen);
+
+  Sha256.initHmac((uint8_t*)key, strlen(key));
+  Sha256.write(buf, len - UBSUB_SIGNATURE_LEN);
+  memcpy(buf + len - UBSUB_SIGNATURE_LEN, Sha256.resultHmac(), 32);
+}
+
 
 // STATIC HELPERS ===============
 
@@ -1047,6 +2417,24 @@ static uint64_t getTime() {
 #endif
 }
 
+// Monotonic milliseconds, unaffected by time syncs. Drives timers and RTT measurement
+static uint64_t getTimeMillis() {
+#if ARDUINO || PARTICLE
+  // millis() wraps every ~49 days; extend it to 64 bits
+  static uint32_t last = 0;
+  static uint64_t high = 0;
+  const uint32_t now = millis();
+  if (now < last)
+    high += 0x100000000ULL;
+  last = now;
+  return high + now;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
 // Get random nonce
 static uint32_t getNonce32() {
 #if ARDUINO || PARTICLE
@@ -1068,3 +2456,34 @@ static uint64_t getNonce64() {
 static int min(int left, int right) {
   return left < right ? left : right;
 }
+
+#if !(ARDUINO || PARTICLE)
+static void runWorkerEvent(void* slot, void* userData) {
+  const WorkerEvent* we = (const WorkerEvent*)slot;
+  UbsubEvent event;
+  event.topic = we->topic;
+  event.data = we->data;
+  event.len = we->len;
+  event.nonce = we->nonce;
+  event.flags = we->flags;
+  we->handler(event);
+}
+
+// Log-linear buckets: exact below 8us, then 4 buckets per power of two (<= 25% error)
+static int latencyBucket(uint32_t micros) {
+  if (micros < 8)
+    return micros;
+  int msb = 31 - __builtin_clz(micros);
+  int bucket = (msb - 1) * 4 + ((micros >> (msb - 2)) & 0x3);
+  return bucket < UBSUB_LATENCY_BUCKETS ? bucket : UBSUB_LATENCY_BUCKETS - 1;
+}
+
+// Largest value that falls into bucket
+static uint32_t latencyBucketMax(int bucket) {
+  if (bucket < 8)
+    return bucket;
+  int msb = bucket / 4 + 1;
+  uint64_t max = ((uint64_t)(4 + bucket % 4 + 1) << (msb - 2)) - 1;
+  return max > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)max;
+}
+#endif
@@ -1,4 +1,12 @@
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "nonceindex.h"
+#include "timerwheel.h"
+#include "persistqueue.h"
+#include "replayfilter.h"
+#include "workerpool.h"
+#include "topictrie.h"
 
 #ifndef ubsub_h
 #define ubsub_h
@@ -10,23 +18,140 @@
   #include <Particle.h>
   typedef UDP UDPSocket;
 #else
+  #include <sys/socket.h>
+  #include <netinet/in.h>
   typedef int UDPSocket;
 #endif
 
 typedef void (*TopicCallback)(const char* arg);
 
+// An event received on a subscription. Points into the receive buffer, so is only valid
+// for the duration of the callback; copy anything that needs to outlive it
+typedef struct UbsubEvent {
+  const char* topic; // As subscribed to, or as named by the router once acked
+  const uint8_t* data; // Not NUL terminated, may be binary
+  int len;
+  uint64_t nonce; // Of the packet that carried the event
+  uint8_t flags; // SUB_MSG flags as sent by the router
+} UbsubEvent;
+
+typedef void (*EventCallback)(const UbsubEvent& event);
+typedef void (*EventHandler)(const UbsubEvent& event, void* userData);
+
+#define UBSUB_HANDLER_WORDS 3 // Pointer-sized words of state a UbsubHandler can hold inline
+
+// Type-erased event handler, held by value so registering one never allocates.
+// Wraps an EventHandler with its userData, an EventCallback or TopicCallback, or (C++11)
+// any trivially copyable callable taking const UbsubEvent&, such as a lambda capturing a
+// few pointers. Calling one costs one indirect call, plus any the callable makes itself
+class UbsubHandler {
+private:
+  EventHandler invoke;
+  bool inlined; // Whether invoke wants the inline state rather than userData
+  union {
+    void* userData;
+    TopicCallback topicCallback;
+    EventCallback eventCallback;
+    void* words[UBSUB_HANDLER_WORDS];
+    uint64_t align;
+    double alignDouble;
+  } state;
+
+  static void callTopicCallback(const UbsubEvent& event, void* state);
+  static void callEventCallback(const UbsubEvent& event, void* state);
+  #if __cplusplus >= 201103L
+  template<typename F>
+  static void callFunctor(const UbsubEvent& event, void* state) {
+    (*(F*)state)(event);
+  }
+  #endif
+
+public:
+  UbsubHandler() : invoke(NULL), inlined(false) {
+    this->state.userData = NULL;
+  }
+
+  UbsubHandler(EventHandler handler, void* userData) : invoke(handler), inlined(false) {
+    this->state.userData = userData;
+  }
+
+  UbsubHandler(TopicCallback callback) : invoke(callback != NULL ? callTopicCallback : NULL), inlined(true) {
+    this->state.topicCallback = callback;
+  }
+
+  UbsubHandler(EventCallback callback) : invoke(callback != NULL ? callEventCallback : NULL), inlined(true) {
+    this->state.eventCallback = callback;
+  }
+
+  #if __cplusplus >= 201103L
+  // Only for callables, so other arguments (eg. NULL) don't end up here
+  template<typename F, typename = decltype((*(const F*)0)(*(const UbsubEvent*)0))>
+  UbsubHandler(const F& functor) : invoke(callFunctor<F>), inlined(true) {
+    static_assert(sizeof(F) <= sizeof(state), "Handler state too large, raise UBSUB_HANDLER_WORDS or capture a pointer");
+    static_assert(alignof(F) <= alignof(decltype(state)), "Handler state over-aligned");
+    static_assert(__is_trivially_copyable(F), "Handlers are copied bytewise, so must be trivially copyable");
+    memcpy(&this->state, &functor, sizeof(F));
+  }
+  #endif
+
+  bool empty() const {
+    return this->invoke == NULL;
+  }
+
+  void operator()(const UbsubEvent& event) const {
+    this->invoke(event, this->inlined ? (void*)&this->state : this->state.userData);
+  }
+};
+
+// Called once a published message is done with. status is UBSUB_DELIVERY_ACKED or
+// UBSUB_DELIVERY_DUPE when the router acked it, or an error code (eg. UBSUB_ERR_TIMEOUT)
+typedef void (*DeliveryCallback)(uint64_t handle, int status, void* userData);
+
+class MiniJsonBuilder;
+
 // Configurable settings
 #define UBSUB_ERROR_BUFFER_LEN 16
 #define UBSUB_MTU 256
-#define UBSUB_PACKET_RETRY_SECONDS 2
 #define UBSUB_PACKET_RETRY_ATTEMPTS 5
+#define UBSUB_RTO_INITIAL_MILLIS 1000 // Retransmit timeout until the first RTT sample
+#define UBSUB_RTO_MIN_MILLIS 200
+#define UBSUB_RTO_MAX_MILLIS 8000 // Also caps the exponential backoff
 #define UBSUB_PACKET_TIMEOUT 10
 #define UBSUB_PING_FREQ 30
 #define UBSUB_CONNECTION_TIMEOUT 120
 #define UBSUB_SUBSCRIPTION_TTL 60*5 // 5 minutes
-#define UBSUB_NONCE_RR_COUNT 32 // Number of nonces to track
 #define UBSUB_TIME_SYNC_FREQ 12*60*60
 #define UBSUB_WATCH_CHECK_FREQ 60
+#if ARDUINO || PARTICLE
+  #define UBSUB_QUEUE_CAPACITY 8 // Reliable messages awaiting ack. Each slot holds a full MTU packet
+  #define UBSUB_REPLAY_RATE 2 // Inbound events/sec the replay filter is sized for, on top of acks for the queue
+  #define UBSUB_SUBSCRIPTION_CAPACITY 4 // Initial size of the subscription table, doubles when full
+  #define UBSUB_RECV_BUDGET 8 // Datagrams handled per processEvents(), the rest wait in the socket
+#else
+  #define UBSUB_QUEUE_CAPACITY 1024
+  #define UBSUB_REPLAY_RATE 4096
+  #define UBSUB_SUBSCRIPTION_CAPACITY 64
+  #define UBSUB_RECV_BUDGET 256
+#endif
+#define UBSUB_WORKER_QUEUE_DEPTH 256 // Events each worker thread can have waiting (unix only)
+#define UBSUB_BATCH_MAX_PACKETS 64 // Max packets coalesced into one GSO send (linux only)
+#define UBSUB_RECV_BUFFER_LEN 65535 // Large enough for one GRO-coalesced burst (linux only)
+#ifndef UBSUB_SOCKET_RCVBUF
+#define UBSUB_SOCKET_RCVBUF 0 // Kernel receive buffer bytes, 0 for system default (unix only)
+#endif
+#ifndef UBSUB_SOCKET_SNDBUF
+#define UBSUB_SOCKET_SNDBUF 0 // Kernel send buffer bytes, 0 for system default (unix only)
+#endif
+#define UBSUB_MAX_ROUTER_ADDRS 4 // Resolved router addresses we accept packets from (unix only)
+#define UBSUB_MAX_PATTERN_MATCHES 8 // Pattern subscriptions one event can be handled by
+#define UBSUB_SUB_ACK_BATCH 16 // Max events acked in one packet, when the router supports it
+#define UBSUB_SUB_ACK_DELAY_MILLIS 20 // Longest an event's ack is held for a batch before an inline handler runs
+#define UBSUB_HELD_DELIVERIES 4 // Delivery callbacks that can wait for a publish to finish (see holdDeliveries)
+#define UBSUB_BULK_WINDOW_PERCENT 75 // Share of the send window bulk messages may fill, the rest is kept for alarms
+#define UBSUB_PERSIST_SEGMENT_BYTES 64*1024 // Size of each persistent queue segment file (unix only)
+#define UBSUB_PERSIST_MAX_SEGMENTS 64
+#define UBSUB_PERSIST_SYNC_MILLIS 100 // Persistent queue appends and acks are flushed to disk at most this often
+#define UBSUB_LATENCY_BUCKETS 128 // Log-linear receive latency histogram, covers up to ~1 hour in micros (unix only)
 
 // If defined, will log to stderr on unix, and Serial on embedded
 // Not enabled by default but feel free to build with -DUBSUB_LOG or uncomment below
@@ -46,43 +171,138 @@ typedef void (*TopicCallback)(const char* arg);
 #define UBSUB_ERR_SEND -10
 #define UBSUB_ERR_BAD_REQUEST -11
 #define UBSUB_ERR_NONCE_DUPE -12
+#define UBSUB_ERR_QUEUE_FULL -13
+#define UBSUB_ERR_WOULD_BLOCK -14
+#define UBSUB_ERR_EXPIRED -15
+#define UBSUB_ERR_SUPERSEDED -16
+#define UBSUB_ERR_REPLAY_FULL -17
+#define UBSUB_ERR_BAD_PATTERN -18
 #define UBSUB_MISSING_ARGS -50
 #define UBSUB_ERR_UNKNOWN -1000
 #define UBSUB_ERR_MALLOC -2000
 
+// Priority classes. Retries of higher classes go out first, and when the queue is full,
+// queued bulk messages are dropped to make room for control and alarm messages
+#define UBSUB_PRIORITY_CONTROL 0 // Subscriptions
+#define UBSUB_PRIORITY_ALARM 1
+#define UBSUB_PRIORITY_BULK 2 // Telemetry, the default for published messages
+#define UBSUB_PRIORITY_CLASSES 3
+
+// Delivery statuses
+#define UBSUB_DELIVERY_ACKED 0
+#define UBSUB_DELIVERY_DUPE 1 // Acked, but the router had already received it
+
+typedef struct PublishOptions {
+  DeliveryCallback onDelivery; // Only called for reliable (auto-retry) messages
+  void* userData;
+  uint8_t priority; // UBSUB_PRIORITY_*
+  uint32_t ttlMillis; // Give up on the message once it's this old, 0 to retry until attempts run out
+  bool coalesce; // Latest value wins: replaces any coalesced message to the same topic still awaiting an ack
+
+  PublishOptions() {
+    this->onDelivery = NULL;
+    this->userData = NULL;
+    this->priority = UBSUB_PRIORITY_BULK;
+    this->ttlMillis = 0;
+    this->coalesce = false;
+  }
+} PublishOptions;
+
+typedef struct UbsubStats {
+  uint32_t packetsSent;
+  uint32_t packetsReceived;
+  uint32_t kernelDrops; // Datagrams the kernel dropped because the receive buffer was full (linux only)
+  uint32_t foreignDrops; // Datagrams discarded because they didn't come from the router
+  int recvBufferSize; // Buffer sizes actually granted by the kernel, 0 if unknown
+  int sendBufferSize;
+
+  // Time from the kernel receiving a packet to us finishing processing it (unix only)
+  uint32_t latencySamples;
+  uint32_t latencyP50Micros;
+  uint32_t latencyP90Micros;
+  uint32_t latencyP99Micros;
+  uint32_t latencyMaxMicros;
+
+  // Round trip to the router, measured from acks of messages that weren't retransmitted
+  uint32_t rttSamples;
+  uint32_t srttMillis; // Smoothed RTT
+  uint32_t rttvarMillis; // RTT variation
+  uint32_t rtoMillis; // Current retransmit timeout, before backoff
+  uint32_t retransmits;
+  uint32_t shedMessages; // Bulk messages dropped from a full queue to make room for higher priorities
+  uint32_t expiredMessages; // Messages whose TTL ran out before they were acked
+  uint32_t supersededMessages; // Coalesced messages replaced by a newer one before they were acked
+  uint32_t workerDrops; // Events left un-acked because their worker's queue was full (unix only)
+  uint32_t rateLimitedEvents; // Events over their subscription's rate limit, dropped before the signature check
+  uint32_t recvBudgetHits; // Receives that stopped at the budget with datagrams possibly still waiting
+} UbsubStats;
+
+// Slots are allocated once, at construction, and recycled through a free list
 typedef struct QueuedMessage {
-  uint8_t* buf;
+  uint8_t buf[UBSUB_MTU];
   int bufLen;
-  uint64_t retryTime;
+  TimerNode timer; // Next retry
   int retryNumber;
+  uint64_t sentTime; // Millis of first transmission, for RTT sampling
+  uint64_t expires; // Millis, 0 if no TTL
+  uint64_t stampTime; // Packet timestamp, so long-lived retries can be re-stamped
+  int64_t persistRef; // Record in the persistent queue, or -1
+  DeliveryCallback onDelivery;
+  void* userData;
   uint64_t cancelNonce;
-  QueuedMessage* next;
+  uint64_t coalesceKey; // Hash of topic and key if coalesced, else 0
+  uint8_t priority;
+  QueuedMessage* dueNext; // Retries of the same class that came due together
+  QueuedMessage* prev;
+  QueuedMessage* next; // Next queued message, or next free slot
 } QueuedMessage;
 
+// Delivery callback of a message already removed from the queue, waiting to be called
+typedef struct HeldDelivery {
+  DeliveryCallback onDelivery;
+  void* userData;
+  uint64_t handle;
+  int status;
+} HeldDelivery;
+
 typedef struct SubscribedFunc {
-  uint64_t renewTime;
+  uint64_t renewTime; // As given by the router
+  TimerNode renewTimer;
   uint64_t requestNonce;
   uint64_t funcId;
-  char topicNameOrId[33];
+  char topicNameOrId[33]; // As subscribed to, so patterns are renewed as patterns
+  char topicId[17]; // Assigned by the router, empty until acked
   char subscriptionId[17];
   char subscriptionKey[33];
-  TopicCallback callback;
-  SubscribedFunc* next;
+  uint64_t topicHash; // Of the topic as first subscribed to, so later listeners share the subscription
+  bool pattern; // Topic has wildcards (see TopicTrie)
+  int firstHandler; // Index in handlers, -1 if none
+  int lastHandler;
+  uint32_t rateTokens; // Thousandths of an event (see setEventRateLimit)
+  uint64_t rateRefill; // Millis tokens were last added, 0 while the bucket is full
 } SubscribedFunc;
 
+// A local handler of a subscription. Handlers of one subscription are chained in the order added
+typedef struct SubscriptionHandler {
+  UbsubHandler handler;
+  int next; // Index of the next handler of the same subscription, -1 for none
+} SubscriptionHandler;
+
 typedef struct VariableWatch {
   const uint8_t* ptr;
   int len;
   uint8_t format;
   char name[33];
   uint32_t hash;
-  uint64_t lastCheck;
+  TimerNode timer; // Next check
   VariableWatch* next;
 } VariableWatch;
 
 class Ubsub {
 public:
-  Ubsub(const char *deviceId, const char *deviceKey, const char *ubsubHost, int ubsubPort);
+  // queueCapacity is the max number of reliable messages that can await an ack at once.
+  // When full, sends that need an ack fail with UBSUB_ERR_QUEUE_FULL
+  Ubsub(const char *deviceId, const char *deviceKey, const char *ubsubHost, int ubsubPort, int queueCapacity = UBSUB_QUEUE_CAPACITY);
 
   Ubsub(const char *deviceId, const char *deviceKey);
 
@@ -108,13 +328,27 @@ public:
   int publishEvent(const char *topicNameOrId, const char *topicKey, const char *msg);
   int publishEvent(const char *topicNameOrId, const char *msg);
 
+  // As above, with a callback once the router acks the message or retries run out.
+  // If handle isn't NULL, it's set to the message's handle, as later passed to the callback
+  int publishEvent(const char *topicNameOrId, const char *topicKey, const char *msg, const PublishOptions &options, uint64_t *handle = NULL);
+
   // Listen to a given topic for events. Similar to creating a function
   // but will listen to an existing topic
+  // The handler can be a TopicCallback, or an EventCallback, which gets the event's data and
+  // length without a copy so binary payloads work. See UbsubHandler for the other forms
+  void listenToTopic(const char *topicNameOrId, const UbsubHandler &handler);
+
+  // Also picks out a NULL callback, which subscribes without a handler
   void listenToTopic(const char *topicNameOrId, TopicCallback callback);
 
+  // As above, passing userData to every call of handler
+  void listenToTopic(const char *topicNameOrId, EventHandler handler, void* userData);
+
   // Create a new function that can be invoked by another caller, and immediately listen to it
   // This function will be a topic in ubsub
+  void createFunction(const char *name, const UbsubHandler &handler);
   void createFunction(const char *name, TopicCallback callback);
+  void createFunction(const char *name, EventHandler handler, void* userData);
 
   // Call function on another device
   int callFunction(const char *name, const char *arg);
@@ -136,9 +370,63 @@ public:
   // Gets the number of queued events
   int getQueueSize();
 
+  // Milliseconds until processEvents() next has scheduled work to do (retries,
+  // pings, renewals, watches), or -1 if nothing is scheduled. Callers that sleep
+  // between calls can use this to sleep no longer than necessary
+  int getNextWakeup();
+
+  // Gets counters for traffic and drops since the client was created (or last reset)
+  const UbsubStats& getStats();
+  void resetStats();
+
+  // Size the kernel socket buffers in bytes (unix only), 0 for system default
+  // Must be called before connect() to take effect
+  void setSocketBuffers(int recvBytes, int sendBytes);
+
+  // Low-latency receive mode (linux only). Asks the kernel to busy poll the device
+  // queue (SO_BUSY_POLL/SO_PREFER_BUSY_POLL), and processEvents() will spin on a
+  // non-blocking receive for spinMicros instead of returning straight away, so the
+  // caller should not sleep between calls. If cpu >= 0, the calling thread is pinned
+  // to that core. Pass 0 to return to normal polling
+  void enableBusyPoll(int spinMicros, int cpu = -1);
+
+  // Bounds the messages awaiting an ack (and their total packet bytes, if maxBytes > 0).
+  // When the window is full, publishEvent() processes events for up to blockMillis
+  // waiting for acks, then returns UBSUB_ERR_WOULD_BLOCK. 0 for either limit is no limit
+  void setSendWindow(int maxMessages, int maxBytes = 0, int blockMillis = 0);
+
+  // Keep un-acked messages in a crash-safe log in dir (unix only), so they survive a
+  // restart. Messages left over from a previous run are resent on connect().
+  // Call before connect(). Returns false if the log couldn't be opened
+  bool enablePersistentQueue(const char *dir);
+
+  // Run subscription handlers on a pool of worker threads (unix only), so slow handlers
+  // don't hold up the network loop. Events are copied into a bounded queue per worker,
+  // and all events of a topic go to the same worker so they're handled in order. When
+  // that queue is full the event is left un-acked, for the router to send again later.
+  // Handlers then run concurrently with processEvents() and each other, and must not call
+  // into the client. Pass 0 workers to run handlers inline again
+  bool enableWorkerPool(int workers, int queueDepth = UBSUB_WORKER_QUEUE_DEPTH);
+
+  // Most datagrams one receive (each processEvents()) will handle, so a flood can't keep
+  // the client from returning. Anything more waits in the socket for the next call, and
+  // getNextWakeup() returns 0 until it's been read. 0 for no limit
+  void setReceiveBudget(int packets);
+
+  // Limits each subscription to eventsPerSec, with bursts of up to burst events (default
+  // eventsPerSec). Events over the limit are dropped before their signature is checked and
+  // left un-acked, so the router sends them again later. 0 for no limit
+  void setEventRateLimit(int eventsPerSec, int burst = 0);
+
   // Wait for the queue to be flushed (blocking)
   void flush(int timeout = -1);
 
+  // Outbound packets sent between beginBatch() and endBatch() are held back and
+  // flushed together. On linux, runs of equal-sized packets go out as a single
+  // UDP_SEGMENT (GSO) send when the kernel supports it. Calls may be nested
+  void beginBatch();
+  void endBatch();
+
   // Gets the last error, or NULL if no error
   const int getLastError();
 
@@ -154,36 +442,132 @@ private: // Config
   UDPSocket sock;
   bool socketInit;
 
+  // Outbound batching (see beginBatch)
+  int batchDepth;
+  #if !(ARDUINO || PARTICLE)
+  int batchCount;
+  int batchLen;
+  int batchSegLen;
+  bool gsoSupported; // Detected at runtime in initSocket, cleared if kernel rejects a send
+  bool groSupported;
+  uint8_t batchBuf[UBSUB_BATCH_MAX_PACKETS * UBSUB_MTU];
+  #endif
+
+  #if !(ARDUINO || PARTICLE)
+  int sockFamily; // AF_INET6 (dual-stack) where available, otherwise AF_INET
+  struct sockaddr_storage routerAddrs[UBSUB_MAX_ROUTER_ADDRS]; // In the socket's family (v4 addresses are mapped on dual-stack)
+  socklen_t routerAddrLens[UBSUB_MAX_ROUTER_ADDRS];
+  int routerAddrCount;
+  int routerAddrIdx; // Address we send to. -1 while connect() is racing pings to all of them
+  int recvAddrIdx; // Address the packet being processed came from
+  #endif
+
+  int recvBufferBytes;
+  int sendBufferBytes;
+  int busyPollMicros;
+  int recvBudget;
+  int eventRate; // Per subscription per second, 0 for no limit
+  int eventBurst;
+  uint32_t lastKernelDrops; // Last cumulative SO_RXQ_OVFL counter seen on this socket
+
   int lastError[UBSUB_ERROR_BUFFER_LEN];
 
 private: // State
-  uint64_t lastPong;
-  uint64_t lastPing;
+  UbsubStats stats;
+  #if !(ARDUINO || PARTICLE)
+  uint32_t latencyBuckets[UBSUB_LATENCY_BUCKETS];
+  #endif
+
+  uint8_t expandedKey[32]; // Cipher key of version 0x3 packets, derived from deviceKey once
+  bool recvPending; // Last receive stopped at the budget
+  int processingDepth; // receiveData/processTimers calls in progress, > 0 while callbacks run
+
+  uint64_t lastPong; // Millis
+  bool multiAck; // Router said (in a pong) it can ack many messages in one CMD_MSG_MULTI_ACK
+  bool batchSubAcks; // Router said (in a pong) it takes many event nonces in one CMD_SUB_MSG_ACK
+  bool patternOnce; // Router said (in a pong) it sends an event once for all our matching patterns
+  uint8_t subAcks[UBSUB_SUB_ACK_BATCH * 8]; // Nonces of accepted events not yet acked
+  int subAckCount;
+  uint64_t subAckSince; // Millis the oldest of subAcks was taken
+  uint64_t msgSeq; // Nonce of the next published message. Sequential, so acks can be sent as bitmaps
+
+  // Retransmit timeout estimation (Jacobson/Karels), all in millis. srtt is 0 until the first sample
+  uint32_t srtt;
+  uint32_t rttvar;
+  uint32_t rto;
 
   uint64_t lastTimeSync;
 
   char watchTopic[33];
 
+  // Everything time-driven (retries, renewals, pings, watches, time sync) is scheduled here
+  TimerWheel timers;
+  TimerNode pingTimer;
+  TimerNode syncTimer;
+
   VariableWatch* watch;
-  QueuedMessage* queue;
-  SubscribedFunc* subs;
-  uint64_t rrnonce[UBSUB_NONCE_RR_COUNT];
-  int lastNonceIdx;
+  QueuedMessage* queueHead[UBSUB_PRIORITY_CLASSES]; // Oldest first, one FIFO per priority class
+  QueuedMessage* queueTail[UBSUB_PRIORITY_CLASSES];
+  QueuedMessage* queueSlots; // Backing storage for all queued messages
+  QueuedMessage* queueFree;
+  HeldDelivery heldDeliveries[UBSUB_HELD_DELIVERIES]; // Oldest first
+  int heldDeliveryCount;
+  int deliveryHolds;
+  int queueCapacity;
+  int queueCount;
+  int queueBytes;
+  int sendWindowMessages;
+  int sendWindowBytes;
+  int sendWindowBlockMillis;
+  NonceIndex queueIndex; // cancelNonce -> slot, so acks don't walk the queue
+  NonceIndex coalesceIndex; // coalesceKey -> slot of the newest coalesced message to that topic
+  #if !(ARDUINO || PARTICLE)
+  PersistentQueue persist;
+  int64_t persistReplayRef; // Last recovered record moved back into the queue
+  bool persistReplayDone;
+  TimerNode persistTimer; // Batches disk syncs
+  WorkerPool workers; // Runs handlers off the network thread, if started
+  #endif
+  SubscribedFunc* subs; // Contiguous table, subCount used
+  int subCount;
+  int subCapacity;
+  NonceIndex subsByFuncId; // funcId -> index in subs
+  NonceIndex subsByNonce; // Outstanding subscribe requestNonce -> index in subs
+  NonceIndex subsByTopic; // topicHash -> index in subs
+  TopicTrie patterns; // Pattern subscriptions -> index in subs
+  SubscriptionHandler* handlers; // Contiguous table, handlerCount used
+  int handlerCount;
+  int handlerCapacity;
+  SubscribedFunc* retiredSubs; // Table outgrown while one of its handlers was running, freed after
+  bool dispatching;
+  ReplayFilter replayFilter; // Nonces of authenticated packets still within UBSUB_PACKET_TIMEOUT
 
 private:
-  void init(const char *deviceId, const char *deviceKey, const char *ubsubHost, const int ubsubPort);
+  void init(const char *deviceId, const char *deviceKey, const char *ubsubHost, const int ubsubPort, const int queueCapacity);
 
   void initSocket();
   void closeSocket();
+  void applyBusyPoll();
+  bool resolveRouter();
+  #if !(ARDUINO || PARTICLE)
+  int findRouterAddr(const struct sockaddr_storage &from, socklen_t fromLen);
+  #endif
   int sendData(const uint8_t* buf, int bufSize);
+  int sendDataNow(const uint8_t* buf, int bufSize);
+  int flushBatch();
 
-  int sendCommand(uint16_t cmd, uint8_t flag, bool retry, const uint64_t &nonce, const uint8_t *command, int commandLen, const uint8_t *optData, int dataLen);
+  int sendCommand(uint16_t cmd, uint8_t flag, bool retry, const uint64_t &nonce, const uint8_t *command, int commandLen, const uint8_t *optData, int dataLen, uint8_t priority = UBSUB_PRIORITY_CONTROL);
   int sendCommand(uint16_t cmd, uint8_t flag, bool retry, const uint8_t *command, int commandLen);
   int sendCommand(uint16_t cmd, uint8_t flag, const uint8_t *command, int commandLen);
 
   int receiveData();
   void processPacket(uint8_t *buf, int len);
-  void processCommand(uint16_t cmd, uint8_t flag, const uint64_t &nonce, const uint8_t* body, int bodyLen);
+  bool admitEvent(const uint8_t *buf, int len, uint8_t version, uint64_t nonce);
+  void processCommand(uint16_t cmd, uint8_t flag, const uint64_t &nonce, uint64_t ts, const uint8_t* body, int bodyLen);
+  bool rememberEvent(const uint64_t &nonce, uint64_t ts);
+
+  void ackEvent(const uint64_t &nonce);
+  void flushEventAcks();
 
   void ping();
 
@@ -191,20 +575,39 @@ private:
 
   void setError(int errcode);
 
-  QueuedMessage* queueMessage(const uint8_t* buf, int bufLen, const uint64_t &nonce);
-  void removeQueue(const uint64_t &nonce);
-  void processQueue();
+  QueuedMessage* queueMessage(const uint8_t* buf, int bufLen, const uint64_t &nonce, uint8_t priority, bool persist = false);
+  bool shedQueue();
+  void removeQueue(const uint64_t &nonce, int status = UBSUB_DELIVERY_ACKED);
+  void removeQueue(QueuedMessage* msg);
+  void supersedeMessage(QueuedMessage* msg);
+  void completeMessage(QueuedMessage* msg, int status);
+  void holdDeliveries();
+  void releaseDeliveries();
+  void processTimers();
+  void retryMessage(QueuedMessage* msg);
+  bool sendWindowOpen(int bytes, uint8_t priority, uint64_t coalesceKey = 0);
+  bool waitForSendWindow(int bytes, uint8_t priority, uint64_t coalesceKey = 0);
+  void replayQueue();
+  void replayPersisted();
+  void sampleRtt(uint32_t rttMillis);
+  uint32_t retryDelay(int retryNumber);
 
   void watchVariable(const char *name, const void* ptr, int len, uint8_t format);
-  void checkWatchedVariables();
-
-  void writeNonce(const uint64_t &nonce);
-  bool hasNonce(const uint64_t &nonce);
+  bool checkWatchedVariable(VariableWatch* watch, MiniJsonBuilder &json);
 
   SubscribedFunc* getSubscribedFuncByNonce(const uint64_t &nonce);
   SubscribedFunc* getSubscribedFuncByFuncId(const uint64_t &funcId);
+  SubscribedFunc* addSubscription(const char *topicNameOrId);
+  bool addHandler(SubscribedFunc* sub, const UbsubHandler &handler);
+  void dispatchEvent(const int* subIdx, int subCount, const UbsubEvent &event);
+  #if !(ARDUINO || PARTICLE)
+  int offloadWorker(const int* subIdx, int subCount, const UbsubEvent &event);
+  void offloadEvent(int worker, const int* subIdx, int subCount, const UbsubEvent &event);
+  #endif
+  bool growSubscriptions();
+  bool indexSubscriptions(int capacity);
   void invalidateSubscriptions(); // Make so all have to be renewed
-  void renewSubscriptions();
+  void renewSubscription(SubscribedFunc* sub);
 
 };
 
@@ -0,0 +1,132 @@
+#if !(ARDUINO || PARTICLE)
+
+#include <stdlib.h>
+#include <string.h>
+#include "workerpool.h"
+
+WorkerPool::WorkerPool() {
+  this->workers = NULL;
+  this->workerCount = 0;
+  this->mask = 0;
+  this->slotBytes = 0;
+  this->func = NULL;
+  this->userData = NULL;
+  this->stopping = false;
+}
+
+WorkerPool::~WorkerPool() {
+  this->stop();
+}
+
+bool WorkerPool::start(int workers, int depth, int slotBytes, WorkerFunc func, void *userData) {
+  this->stop();
+  if (workers <= 0 || depth <= 0 || slotBytes <= 0 || func == NULL)
+    return false;
+
+  uint32_t size = 2;
+  while (size < (uint32_t)depth)
+    size <<= 1;
+
+  this->workers = (Worker*)calloc(workers, sizeof(Worker));
+  if (this->workers == NULL)
+    return false;
+  this->workerCount = workers;
+  this->mask = size - 1;
+  this->slotBytes = (slotBytes + 7) & ~7; // Keep slots 8-byte aligned
+  this->func = func;
+  this->userData = userData;
+  this->stopping = false;
+
+  for (int i=0; i<workers; ++i) {
+    Worker &w = this->workers[i];
+    w.pool = this;
+    w.slots = (uint8_t*)malloc((size_t)this->slotBytes * size);
+    if (w.slots == NULL || sem_init(&w.ready, 0, 0) != 0) {
+      free(w.slots);
+      w.slots = NULL;
+      this->stop();
+      return false;
+    }
+    if (pthread_create(&w.thread, NULL, run, &w) != 0) {
+      sem_destroy(&w.ready);
+      free(w.slots);
+      w.slots = NULL;
+      this->stop();
+      return false;
+    }
+    w.started = true;
+  }
+
+  return true;
+}
+
+void WorkerPool::stop() {
+  if (this->workers == NULL)
+    return;
+
+  __atomic_store_n(&this->stopping, true, __ATOMIC_RELEASE);
+  for (int i=0; i<this->workerCount; ++i) {
+    Worker &w = this->workers[i];
+    if (w.started) {
+      sem_post(&w.ready);
+      pthread_join(w.thread, NULL);
+      sem_destroy(&w.ready);
+    }
+    free(w.slots);
+  }
+
+  free(this->workers);
+  this->workers = NULL;
+  this->workerCount = 0;
+  this->stopping = false;
+}
+
+bool WorkerPool::isRunning() const {
+  return this->workers != NULL;
+}
+
+int WorkerPool::size() const {
+  return this->workerCount;
+}
+
+int WorkerPool::available(int worker) const {
+  const Worker &w = this->workers[worker];
+  const uint32_t head = __atomic_load_n(&w.head, __ATOMIC_ACQUIRE);
+  return (int)(this->mask + 1 - (w.tail - head));
+}
+
+void* WorkerPool::reserve(int worker) {
+  if (this->available(worker) <= 0)
+    return NULL;
+  Worker &w = this->workers[worker];
+  return w.slots + (size_t)(w.tail & this->mask) * this->slotBytes;
+}
+
+void WorkerPool::commit(int worker) {
+  Worker &w = this->workers[worker];
+  __atomic_store_n(&w.tail, w.tail + 1, __ATOMIC_RELEASE);
+  sem_post(&w.ready);
+}
+
+void* WorkerPool::run(void *arg) {
+  Worker &w = *(Worker*)arg;
+  WorkerPool* pool = w.pool;
+
+  while (true) {
+    while (sem_wait(&w.ready) != 0) {} // Retry if interrupted by a signal
+
+    // Every post is a committed slot, except the one from stop() once the ring is empty
+    const uint32_t tail = __atomic_load_n(&w.tail, __ATOMIC_ACQUIRE);
+    if (w.head == tail) {
+      if (__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE))
+        break;
+      continue;
+    }
+
+    pool->func(w.slots + (size_t)(w.head & pool->mask) * pool->slotBytes, pool->userData);
+    __atomic_store_n(&w.head, w.head + 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+#endif
@@ -0,0 +1,73 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef ubsub_workerpool_h
+#define ubsub_workerpool_h
+
+#if !(ARDUINO || PARTICLE)
+
+#include <pthread.h>
+#include <semaphore.h>
+
+/**
+Fixed pool of worker threads, each fed by its own bounded ring of fixed-size slots (unix only).
+
+A single thread produces work: it reserve()s a slot in a worker's ring, fills it in
+place and commit()s it, and that worker later calls the pool's function on it. Each
+ring has exactly one producer and one consumer, so it needs no locks, only ordered
+loads and stores of its head and tail. Idle workers sleep on a semaphore.
+
+Work given to the same worker runs in the order it was committed.
+**/
+
+typedef void (*WorkerFunc)(void* slot, void* userData);
+
+class WorkerPool {
+private:
+  struct Worker {
+    uint8_t* slots;
+    uint32_t head; // Next slot to run. Written by the worker
+    uint8_t pad[60]; // Keep head and tail on separate cache lines
+    uint32_t tail; // Next slot to fill. Written by the producer
+    sem_t ready; // Posted once per committed slot, and once to stop
+    pthread_t thread;
+    WorkerPool* pool;
+    bool started;
+  };
+
+  Worker* workers;
+  int workerCount;
+  uint32_t mask; // Ring depth - 1
+  uint32_t slotBytes;
+  WorkerFunc func;
+  void* userData;
+  bool stopping;
+
+public:
+  WorkerPool();
+  ~WorkerPool();
+
+  // Starts the worker threads, each with a ring of at least depth slots of slotBytes.
+  // func is called on a worker thread for each committed slot.
+  // Returns false if memory or threads couldn't be had
+  bool start(int workers, int depth, int slotBytes, WorkerFunc func, void *userData);
+
+  // Runs whatever is still queued, then joins the workers
+  void stop();
+  bool isRunning() const;
+  int size() const;
+
+  // Slots free in a worker's ring
+  int available(int worker) const;
+
+  // Next free slot of a worker's ring, or NULL if it's full. Only valid until commit()
+  void* reserve(int worker);
+  void commit(int worker);
+
+private:
+  static void* run(void *arg);
+};
+
+#endif
+
+#endif
@@ -1,3 +1,4 @@
 #define CATCH_CONFIG_MAIN
 #define CATCH_CONFIG_FAST_COMPILE
+#define CATCH_CONFIG_NO_POSIX_SIGNALS // Its sigaltstack size isn't a constant expression on glibc >= 2.34
 #include "catch.hpp"
\ No newline at end of file
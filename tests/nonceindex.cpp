@@ -0,0 +1,73 @@
+#include "catch.hpp"
+#include "../src/nonceindex.h"
+
+TEST_CASE("Index empty", "[NonceIndex]") {
+  NonceIndex idx;
+  REQUIRE(idx.init(8));
+  CHECK(idx.size() == 0);
+  CHECK(idx.get(1234) == -1);
+  CHECK_FALSE(idx.remove(1234));
+}
+
+TEST_CASE("Index uninitialized", "[NonceIndex]") {
+  NonceIndex idx;
+  CHECK(idx.get(1) == -1);
+  CHECK_FALSE(idx.put(1, 1));
+}
+
+TEST_CASE("Index put and get", "[NonceIndex]") {
+  NonceIndex idx;
+  REQUIRE(idx.init(8));
+  CHECK(idx.put(0xDEADBEEFCAFEULL, 3));
+  CHECK(idx.put(0, 4));
+  CHECK(idx.size() == 2);
+  CHECK(idx.get(0xDEADBEEFCAFEULL) == 3);
+  CHECK(idx.get(0) == 4);
+}
+
+TEST_CASE("Index replace", "[NonceIndex]") {
+  NonceIndex idx;
+  REQUIRE(idx.init(8));
+  CHECK(idx.put(42, 1));
+  CHECK(idx.put(42, 2));
+  CHECK(idx.size() == 1);
+  CHECK(idx.get(42) == 2);
+}
+
+TEST_CASE("Index full", "[NonceIndex]") {
+  NonceIndex idx;
+  REQUIRE(idx.init(4));
+  for (int i=0; i<4; ++i)
+    CHECK(idx.put(100 + i, i));
+  CHECK_FALSE(idx.put(200, 9));
+  CHECK(idx.put(101, 7)); // Replacing is fine when full
+  CHECK(idx.remove(100));
+  CHECK(idx.put(200, 9));
+  CHECK(idx.get(200) == 9);
+}
+
+TEST_CASE("Index remove keeps probe runs intact", "[NonceIndex]") {
+  NonceIndex idx;
+  REQUIRE(idx.init(512));
+  for (int i=0; i<512; ++i)
+    REQUIRE(idx.put(1000 + i, i));
+
+  // Remove every third, then make sure everything else is still reachable
+  for (int i=0; i<512; i += 3)
+    REQUIRE(idx.remove(1000 + i));
+  for (int i=0; i<512; ++i) {
+    CAPTURE(i);
+    CHECK(idx.get(1000 + i) == (i % 3 == 0 ? -1 : i));
+  }
+  CHECK(idx.size() == 512 - 171);
+}
+
+TEST_CASE("Index clear", "[NonceIndex]") {
+  NonceIndex idx;
+  REQUIRE(idx.init(8));
+  idx.put(1, 1);
+  idx.put(2, 2);
+  idx.clear();
+  CHECK(idx.size() == 0);
+  CHECK(idx.get(1) == -1);
+}
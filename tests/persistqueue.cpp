@@ -0,0 +1,191 @@
+#include "catch.hpp"
+#include "../src/persistqueue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+
+static void makeTempDir(char *dir) {
+  strcpy(dir, "/tmp/ubsub-pq-XXXXXX");
+  REQUIRE(mkdtemp(dir) != NULL);
+}
+
+static int countSegments(const char *dir) {
+  int count = 0;
+  DIR* d = opendir(dir);
+  struct dirent* ent;
+  while ((ent = readdir(d)) != NULL) {
+    if (strstr(ent->d_name, ".seg") != NULL)
+      count++;
+  }
+  closedir(d);
+  return count;
+}
+
+static void removeDir(const char *dir) {
+  char cmd[128];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+  REQUIRE(system(cmd) == 0);
+}
+
+TEST_CASE("Persist closed", "[PersistentQueue]") {
+  PersistentQueue pq;
+  uint8_t buf[4] = {1, 2, 3, 4};
+  CHECK_FALSE(pq.isOpen());
+  CHECK(pq.append(1, buf, 4) == -1);
+  CHECK(pq.nextRecovered(-1) == -1);
+  CHECK(pq.get(0, NULL, NULL) == NULL);
+}
+
+TEST_CASE("Persist append and get", "[PersistentQueue]") {
+  char dir[32];
+  makeTempDir(dir);
+
+  PersistentQueue pq;
+  REQUIRE(pq.open(dir, 4096, 4));
+  uint8_t buf[5] = {1, 2, 3, 4, 5};
+  int64_t ref = pq.append(0xABCD, buf, 5);
+  REQUIRE(ref >= 0);
+  CHECK(pq.size() == 1);
+
+  int len;
+  uint64_t nonce;
+  const uint8_t* data = pq.get(ref, &len, &nonce);
+  REQUIRE(data != NULL);
+  CHECK(len == 5);
+  CHECK(nonce == 0xABCD);
+  CHECK(memcmp(data, buf, 5) == 0);
+
+  // New records aren't "recovered"
+  CHECK(pq.nextRecovered(-1) == -1);
+
+  pq.close();
+  removeDir(dir);
+}
+
+TEST_CASE("Persist recovers un-acked records", "[PersistentQueue]") {
+  char dir[32];
+  makeTempDir(dir);
+
+  {
+    PersistentQueue pq;
+    REQUIRE(pq.open(dir, 4096, 4));
+    uint8_t buf[100];
+    int64_t refs[10];
+    for (int i=0; i<10; ++i) {
+      memset(buf, i, sizeof(buf));
+      refs[i] = pq.append(i, buf, sizeof(buf));
+      REQUIRE(refs[i] >= 0);
+    }
+    pq.ack(refs[0]);
+    pq.ack(refs[3]);
+    pq.ack(refs[3]); // Double ack is harmless
+    CHECK(pq.size() == 8);
+    pq.sync();
+  }
+
+  PersistentQueue pq;
+  REQUIRE(pq.open(dir, 4096, 4));
+  CHECK(pq.size() == 8);
+
+  uint64_t expected[] = {1, 2, 4, 5, 6, 7, 8, 9};
+  int n = 0;
+  for (int64_t ref = pq.nextRecovered(-1); ref >= 0; ref = pq.nextRecovered(ref)) {
+    int len;
+    uint64_t nonce;
+    const uint8_t* data = pq.get(ref, &len, &nonce);
+    REQUIRE(data != NULL);
+    REQUIRE(n < 8);
+    CHECK(nonce == expected[n]);
+    CHECK(len == 100);
+    CHECK(data[99] == (uint8_t)nonce);
+    n++;
+  }
+  CHECK(n == 8);
+
+  pq.close();
+  removeDir(dir);
+}
+
+TEST_CASE("Persist reclaims acked segments", "[PersistentQueue]") {
+  char dir[32];
+  makeTempDir(dir);
+
+  PersistentQueue pq;
+  REQUIRE(pq.open(dir, 4096, 8));
+  uint8_t buf[200] = {0};
+  int64_t refs[60];
+  for (int i=0; i<60; ++i) {
+    refs[i] = pq.append(i, buf, sizeof(buf));
+    REQUIRE(refs[i] >= 0);
+  }
+  const int segs = countSegments(dir);
+  CHECK(segs > 1);
+
+  // Acking everything but the last record leaves only the segment being appended to
+  for (int i=0; i<59; ++i)
+    pq.ack(refs[i]);
+  CHECK(countSegments(dir) == 1);
+  CHECK(pq.size() == 1);
+
+  pq.ack(refs[59]);
+  CHECK(pq.size() == 0);
+  pq.close();
+
+  // Fully acked segments are dropped when reopened
+  REQUIRE(pq.open(dir, 4096, 8));
+  CHECK(countSegments(dir) == 0);
+  CHECK(pq.nextRecovered(-1) == -1);
+
+  pq.close();
+  removeDir(dir);
+}
+
+TEST_CASE("Persist full", "[PersistentQueue]") {
+  char dir[32];
+  makeTempDir(dir);
+
+  PersistentQueue pq;
+  REQUIRE(pq.open(dir, 1024, 2));
+  uint8_t buf[200] = {0};
+  int appended = 0;
+  while (pq.append(appended, buf, sizeof(buf)) >= 0 && appended < 100)
+    appended++;
+  CHECK(appended == 8); // 4 records of 216 bytes per 1k segment
+  CHECK(pq.size() == 8);
+
+  pq.close();
+  removeDir(dir);
+}
+
+TEST_CASE("Persist ignores torn records", "[PersistentQueue]") {
+  char dir[32];
+  makeTempDir(dir);
+
+  {
+    PersistentQueue pq;
+    REQUIRE(pq.open(dir, 4096, 4));
+    uint8_t buf[16] = {0};
+    REQUIRE(pq.append(1, buf, sizeof(buf)) >= 0);
+    REQUIRE(pq.append(2, buf, sizeof(buf)) >= 0);
+    pq.sync();
+  }
+
+  // Clobber the second record's magic, as if the process died mid-append
+  char path[64];
+  snprintf(path, sizeof(path), "%s/00000000.seg", dir);
+  FILE* f = fopen(path, "r+b");
+  REQUIRE(f != NULL);
+  fseek(f, 32, SEEK_SET);
+  const uint32_t zero = 0;
+  fwrite(&zero, sizeof(zero), 1, f);
+  fclose(f);
+
+  PersistentQueue pq;
+  REQUIRE(pq.open(dir, 4096, 4));
+  CHECK(pq.size() == 1);
+
+  pq.close();
+  removeDir(dir);
+}
@@ -0,0 +1,88 @@
+#include "catch.hpp"
+#include "../src/replayfilter.h"
+
+TEST_CASE("Replay uninitialized", "[ReplayFilter]") {
+  ReplayFilter rf;
+  CHECK_FALSE(rf.contains(1, 1000));
+  CHECK_FALSE(rf.insert(1, 1010, 1000));
+}
+
+TEST_CASE("Replay insert and contains", "[ReplayFilter]") {
+  ReplayFilter rf;
+  REQUIRE(rf.init(20, 100));
+
+  const uint64_t now = 1000000;
+  CHECK_FALSE(rf.contains(123, now));
+  REQUIRE(rf.insert(123, now + 10, now));
+  CHECK(rf.contains(123, now));
+  CHECK_FALSE(rf.contains(124, now));
+
+  // Re-inserting is harmless
+  REQUIRE(rf.insert(123, now + 10, now));
+  CHECK(rf.contains(123, now + 5));
+
+  rf.clear();
+  CHECK_FALSE(rf.contains(123, now));
+}
+
+TEST_CASE("Replay nonce 0", "[ReplayFilter]") {
+  ReplayFilter rf;
+  REQUIRE(rf.init(20, 100));
+
+  CHECK_FALSE(rf.contains(0, 5000));
+  REQUIRE(rf.insert(0, 5010, 5000));
+  CHECK(rf.contains(0, 5000));
+}
+
+TEST_CASE("Replay expires", "[ReplayFilter]") {
+  ReplayFilter rf;
+  REQUIRE(rf.init(20, 100));
+
+  const uint64_t now = 2000000;
+  REQUIRE(rf.insert(42, now + 10, now));
+
+  // Still remembered up to its expiry, forgotten once its slice has passed
+  CHECK(rf.contains(42, now + 10));
+  CHECK_FALSE(rf.contains(42, now + 30));
+
+  // Already expired nonces can't be replayed anyway
+  CHECK(rf.insert(43, now - 1, now));
+  CHECK_FALSE(rf.contains(43, now));
+}
+
+TEST_CASE("Replay reuses buckets", "[ReplayFilter]") {
+  ReplayFilter rf;
+  REQUIRE(rf.init(20, 10));
+
+  // Insert at a steady rate for much longer than the window
+  uint64_t nonce = 1;
+  for (uint64_t now = 3000000; now < 3000000 + 200; ++now) {
+    for (int i=0; i<10; ++i) {
+      REQUIRE(rf.insert(nonce, now + 20, now));
+      nonce++;
+    }
+
+    // Everything inserted within the window is still there
+    CHECK(rf.contains(nonce - 1, now));
+    if (nonce > 200)
+      CHECK(rf.contains(nonce - 200, now));
+  }
+}
+
+TEST_CASE("Replay full", "[ReplayFilter]") {
+  ReplayFilter rf;
+  REQUIRE(rf.init(3, 4)); // 1 second slices, 4 nonces each
+
+  const uint64_t now = 4000000;
+  for (uint64_t i=1; i<=4; ++i)
+    REQUIRE(rf.insert(i, now + 2, now));
+  CHECK_FALSE(rf.insert(5, now + 2, now));
+  CHECK_FALSE(rf.contains(5, now));
+
+  // Live nonces are never evicted to make room
+  for (uint64_t i=1; i<=4; ++i)
+    CHECK(rf.contains(i, now));
+
+  // Other slices still have room
+  CHECK(rf.insert(5, now + 3, now));
+}
@@ -0,0 +1,117 @@
+#include "catch.hpp"
+#include <stdlib.h>
+#include "../src/timerwheel.h"
+
+TEST_CASE("Wheel empty", "[TimerWheel]") {
+  TimerWheel w;
+  w.reset(100);
+  CHECK(w.size() == 0);
+  CHECK(w.nextExpiry() == TIMERWHEEL_NEVER);
+  CHECK(w.expire(1000000) == 0);
+  CHECK(w.popExpired() == NULL);
+}
+
+TEST_CASE("Wheel fires when due", "[TimerWheel]") {
+  TimerWheel w;
+  w.reset(0);
+  TimerNode a;
+  initTimer(&a, 1, NULL);
+  w.schedule(&a, 10);
+  CHECK(w.pending(&a));
+  CHECK(w.nextExpiry() == 10);
+
+  CHECK(w.expire(9) == 0);
+  CHECK(w.expire(10) == 1);
+  CHECK(w.popExpired() == &a);
+  CHECK_FALSE(w.pending(&a));
+  CHECK(w.size() == 0);
+}
+
+TEST_CASE("Wheel past times fire immediately", "[TimerWheel]") {
+  TimerWheel w;
+  w.reset(500);
+  TimerNode a;
+  initTimer(&a, 1, NULL);
+  w.schedule(&a, 3);
+  CHECK(w.expire(500) == 1);
+  CHECK(w.popExpired() == &a);
+}
+
+TEST_CASE("Wheel cancel and reschedule", "[TimerWheel]") {
+  TimerWheel w;
+  w.reset(0);
+  TimerNode a, b;
+  initTimer(&a, 1, NULL);
+  initTimer(&b, 2, NULL);
+  w.schedule(&a, 5000);
+  w.schedule(&b, 6000);
+  w.cancel(&a);
+  CHECK(w.size() == 1);
+  w.schedule(&b, 20);
+  CHECK(w.size() == 1);
+  CHECK(w.expire(10000) == 1);
+  CHECK(w.popExpired() == &b);
+  CHECK(w.popExpired() == NULL);
+}
+
+TEST_CASE("Wheel cancel expired before pop", "[TimerWheel]") {
+  TimerWheel w;
+  w.reset(0);
+  TimerNode a, b;
+  initTimer(&a, 1, NULL);
+  initTimer(&b, 2, NULL);
+  w.schedule(&a, 1);
+  w.schedule(&b, 1);
+  CHECK(w.expire(1) == 2);
+  w.cancel(&a);
+  CHECK(w.popExpired() == &b);
+  CHECK(w.popExpired() == NULL);
+}
+
+TEST_CASE("Wheel next expiry is a lower bound", "[TimerWheel]") {
+  TimerWheel w;
+  w.reset(12345);
+  TimerNode a;
+  initTimer(&a, 1, NULL);
+  w.schedule(&a, 12345 + 300000);
+  CHECK(w.nextExpiry() <= 12345 + 300000);
+  CHECK(w.nextExpiry() > 12345);
+}
+
+TEST_CASE("Wheel matches brute force", "[TimerWheel]") {
+  const int N = 2000;
+  static TimerNode nodes[N];
+  TimerWheel w;
+  uint64_t now = 1000;
+  w.reset(now);
+  srand(42);
+
+  for (int i=0; i<N; ++i) {
+    initTimer(&nodes[i], 0, NULL);
+    // Mix of near, far and beyond-range timers
+    uint64_t range = (i % 4 == 0) ? 64 : (i % 4 == 1) ? 5000 : (i % 4 == 2) ? 400000 : 40000000;
+    w.schedule(&nodes[i], now + (uint64_t)rand() % range);
+  }
+
+  int fired = 0;
+  while (fired < N) {
+    uint64_t hint = w.nextExpiry();
+    REQUIRE(hint >= now);
+    now += 1 + rand() % 3000;
+    w.expire(now);
+    TimerNode* node;
+    while ((node = w.popExpired()) != NULL) {
+      REQUIRE(node->expires <= now);
+      REQUIRE(node->expires >= hint);
+      fired++;
+    }
+    // Nothing still pending should have been due
+    int late = 0;
+    for (int i=0; i<N; ++i) {
+      if (w.pending(&nodes[i]) && nodes[i].expires <= now)
+        late++;
+    }
+    REQUIRE(late == 0);
+  }
+  CHECK(w.size() == 0);
+}
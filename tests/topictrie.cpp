@@ -0,0 +1,124 @@
+#include "catch.hpp"
+#include "../src/topictrie.h"
+#include <stdio.h>
+#include <algorithm>
+
+static int matchSorted(const TopicTrie &trie, const char *topic, int *values, int maxValues) {
+  const int n = trie.match(topic, values, maxValues);
+  std::sort(values, values + std::min(n, maxValues));
+  return n;
+}
+
+TEST_CASE("Trie empty", "[TopicTrie]") {
+  TopicTrie trie;
+  int values[4];
+  CHECK(trie.size() == 0);
+  CHECK(trie.match("a/b", values, 4) == 0);
+  CHECK(trie.find("a/b") == -1);
+}
+
+TEST_CASE("Trie patterns", "[TopicTrie]") {
+  CHECK(TopicTrie::isPattern("sensors/*/temp"));
+  CHECK(TopicTrie::isPattern("sensors/#"));
+  CHECK(TopicTrie::isPattern("*"));
+  CHECK_FALSE(TopicTrie::isPattern("sensors/temp"));
+  CHECK_FALSE(TopicTrie::isPattern("sensors/a*b/c#"));
+
+  CHECK(TopicTrie::isValidPattern("sensors/#"));
+  CHECK(TopicTrie::isValidPattern("#"));
+  CHECK_FALSE(TopicTrie::isValidPattern("sensors/#/temp"));
+
+  TopicTrie trie;
+  CHECK_FALSE(trie.insert("a/#/b", 1));
+  CHECK_FALSE(trie.insert("a/b", -1));
+  CHECK(trie.size() == 0);
+}
+
+TEST_CASE("Trie exact", "[TopicTrie]") {
+  TopicTrie trie;
+  REQUIRE(trie.insert("sensors/kitchen/temp", 1));
+  REQUIRE(trie.insert("sensors/kitchen", 2));
+  CHECK(trie.size() == 2);
+
+  int values[4];
+  REQUIRE(trie.match("sensors/kitchen/temp", values, 4) == 1);
+  CHECK(values[0] == 1);
+  REQUIRE(trie.match("sensors/kitchen", values, 4) == 1);
+  CHECK(values[0] == 2);
+  CHECK(trie.match("sensors", values, 4) == 0);
+  CHECK(trie.match("sensors/kitchen/temp/x", values, 4) == 0);
+
+  // Replacing keeps the count
+  REQUIRE(trie.insert("sensors/kitchen", 5));
+  CHECK(trie.size() == 2);
+  CHECK(trie.find("sensors/kitchen") == 5);
+  CHECK(trie.find("sensors") == -1);
+}
+
+TEST_CASE("Trie wildcards", "[TopicTrie]") {
+  TopicTrie trie;
+  REQUIRE(trie.insert("sensors/*/temp", 1));
+  REQUIRE(trie.insert("sensors/#", 2));
+  REQUIRE(trie.insert("*/kitchen/*", 3));
+  REQUIRE(trie.insert("#", 4));
+  REQUIRE(trie.insert("sensors/kitchen/temp", 5));
+  CHECK(trie.find("sensors/*/temp") == 1);
+
+  int values[8];
+  REQUIRE(matchSorted(trie, "sensors/kitchen/temp", values, 8) == 5);
+  CHECK(values[0] == 1);
+  CHECK(values[1] == 2);
+  CHECK(values[2] == 3);
+  CHECK(values[3] == 4);
+  CHECK(values[4] == 5);
+
+  REQUIRE(matchSorted(trie, "sensors/hall/temp", values, 8) == 3);
+  CHECK(values[0] == 1);
+  CHECK(values[1] == 2);
+  CHECK(values[2] == 4);
+
+  // '#' matches zero levels too, '*' needs exactly one
+  REQUIRE(matchSorted(trie, "sensors", values, 8) == 2);
+  CHECK(values[0] == 2);
+  CHECK(values[1] == 4);
+  REQUIRE(matchSorted(trie, "sensors/temp", values, 8) == 2);
+
+  REQUIRE(matchSorted(trie, "other", values, 8) == 1);
+  CHECK(values[0] == 4);
+
+  // Empty levels are levels
+  REQUIRE(matchSorted(trie, "sensors//temp", values, 8) == 3);
+}
+
+TEST_CASE("Trie more matches than room", "[TopicTrie]") {
+  TopicTrie trie;
+  REQUIRE(trie.insert("a/#", 1));
+  REQUIRE(trie.insert("a/*", 2));
+  REQUIRE(trie.insert("#", 3));
+
+  int values[2] = {-1, -1};
+  CHECK(trie.match("a/b", values, 2) == 3);
+  CHECK(values[0] >= 1);
+  CHECK(values[1] >= 1);
+}
+
+TEST_CASE("Trie many", "[TopicTrie]") {
+  TopicTrie trie;
+  char topic[32];
+  for (int i=0; i<500; ++i) {
+    snprintf(topic, sizeof(topic), "dev%d/*/temp", i);
+    REQUIRE(trie.insert(topic, i));
+  }
+  CHECK(trie.size() == 500);
+
+  int values[4];
+  REQUIRE(trie.match("dev123/x/temp", values, 4) == 1);
+  CHECK(values[0] == 123);
+  CHECK(trie.match("dev123/x/hum", values, 4) == 0);
+
+  trie.clear();
+  CHECK(trie.size() == 0);
+  CHECK(trie.match("dev123/x/temp", values, 4) == 0);
+  REQUIRE(trie.insert("dev1/#", 7));
+  CHECK(trie.match("dev1/x", values, 4) == 1);
+}
@@ -0,0 +1,128 @@
+#include "catch.hpp"
+#include "../src/ubsub.h"
+#include <string.h>
+
+// Never connected, so published messages just wait in the queue for an ack
+
+typedef struct {
+  int calls;
+  int lastStatus;
+  void* lastUserData;
+} Deliveries;
+
+static Deliveries deliveries;
+
+static void onDelivery(uint64_t handle, int status, void* userData) {
+  deliveries.calls++;
+  deliveries.lastStatus = status;
+  deliveries.lastUserData = userData;
+}
+
+static PublishOptions coalesced(void* userData) {
+  PublishOptions options;
+  options.priority = UBSUB_PRIORITY_ALARM; // All of the window
+  options.coalesce = true;
+  options.onDelivery = onDelivery;
+  options.userData = userData;
+  return options;
+}
+
+TEST_CASE("Coalesced message replaces the queued one", "[Ubsub]") {
+  memset(&deliveries, 0, sizeof(deliveries));
+  Ubsub client("dev", "key", "127.0.0.1", 4001, 8);
+  client.setSendWindow(2);
+
+  REQUIRE(client.publishEvent("other", NULL, "x", coalesced((void*)0)) != UBSUB_ERR_WOULD_BLOCK);
+  REQUIRE(client.publishEvent("temp", NULL, "1", coalesced((void*)1)) != UBSUB_ERR_WOULD_BLOCK);
+  CHECK(client.getQueueSize() == 2);
+
+  // The window is full, but not once the old value is dropped
+  REQUIRE(client.publishEvent("temp", NULL, "2", coalesced((void*)2)) != UBSUB_ERR_WOULD_BLOCK);
+  CHECK(client.getQueueSize() == 2);
+  CHECK(deliveries.calls == 1);
+  CHECK(deliveries.lastStatus == UBSUB_ERR_SUPERSEDED);
+  CHECK(deliveries.lastUserData == (void*)1);
+  CHECK(client.getStats().supersededMessages == 1);
+}
+
+TEST_CASE("Coalesced message blocked by the window keeps the queued one", "[Ubsub]") {
+  memset(&deliveries, 0, sizeof(deliveries));
+  Ubsub client("dev", "key", "127.0.0.1", 4001, 8);
+  client.setSendWindow(0, 300); // Room for two small packets
+
+  REQUIRE(client.publishEvent("other", NULL, "x", coalesced((void*)0)) != UBSUB_ERR_WOULD_BLOCK);
+  REQUIRE(client.publishEvent("temp", NULL, "1", coalesced((void*)1)) != UBSUB_ERR_WOULD_BLOCK);
+
+  // Too big to fit even in place of the old value
+  char big[101];
+  memset(big, 'b', 100);
+  big[100] = '\0';
+  CHECK(client.publishEvent("temp", NULL, big, coalesced((void*)2)) == UBSUB_ERR_WOULD_BLOCK);
+  CHECK(client.getQueueSize() == 2);
+  CHECK(deliveries.calls == 0);
+  CHECK(client.getStats().supersededMessages == 0);
+}
+
+TEST_CASE("Coalesced message takes the replaced slot of a full queue", "[Ubsub]") {
+  memset(&deliveries, 0, sizeof(deliveries));
+  Ubsub client("dev", "key", "127.0.0.1", 4001, 2);
+
+  REQUIRE(client.publishEvent("other", NULL, "x", coalesced((void*)0)) != UBSUB_ERR_QUEUE_FULL);
+  REQUIRE(client.publishEvent("temp", NULL, "1", coalesced((void*)1)) != UBSUB_ERR_QUEUE_FULL);
+  CHECK(client.publishEvent("temp", NULL, "2", coalesced((void*)2)) != UBSUB_ERR_QUEUE_FULL);
+  CHECK(client.getQueueSize() == 2);
+  CHECK(deliveries.calls == 1);
+  CHECK(deliveries.lastUserData == (void*)1);
+}
+
+static Ubsub* republisher;
+static int republished;
+
+static void onShedDelivery(uint64_t handle, int status, void* userData) {
+  onDelivery(handle, status, userData);
+  republished = republisher->publishEvent("bulk", NULL, "again");
+}
+
+TEST_CASE("Shed message is told after the new one is queued", "[Ubsub]") {
+  memset(&deliveries, 0, sizeof(deliveries));
+  Ubsub client("dev", "key", "127.0.0.1", 4001, 1);
+  republisher = &client;
+  republished = 0;
+
+  PublishOptions bulk;
+  bulk.onDelivery = onShedDelivery;
+  REQUIRE(client.publishEvent("bulk", NULL, "1", bulk) != UBSUB_ERR_QUEUE_FULL);
+
+  PublishOptions alarm;
+  alarm.priority = UBSUB_PRIORITY_ALARM;
+  CHECK(client.publishEvent("alarm", NULL, "2", alarm) != UBSUB_ERR_QUEUE_FULL);
+  CHECK(deliveries.calls == 1);
+  CHECK(deliveries.lastStatus == UBSUB_ERR_QUEUE_FULL);
+  CHECK(republished == UBSUB_ERR_QUEUE_FULL); // The alarm already has the slot
+  CHECK(client.getStats().shedMessages == 1);
+  CHECK(client.getQueueSize() == 1);
+}
+
+static void onSupersededDelivery(uint64_t handle, int status, void* userData) {
+  onDelivery(handle, status, userData);
+  republished = republisher->publishEvent("other", NULL, "y", coalesced((void*)3));
+}
+
+TEST_CASE("Superseded message is told after the new one is queued", "[Ubsub]") {
+  memset(&deliveries, 0, sizeof(deliveries));
+  Ubsub client("dev", "key", "127.0.0.1", 4001, 1);
+  republisher = &client;
+  republished = 0;
+
+  PublishOptions first = coalesced((void*)1);
+  first.onDelivery = onSupersededDelivery;
+  REQUIRE(client.publishEvent("temp", NULL, "1", first) != UBSUB_ERR_QUEUE_FULL);
+
+  // The new value has the slot before the callback tries to publish
+  CHECK(client.publishEvent("temp", NULL, "2", coalesced((void*)2)) != UBSUB_ERR_QUEUE_FULL);
+  CHECK(deliveries.calls == 1);
+  CHECK(deliveries.lastStatus == UBSUB_ERR_SUPERSEDED);
+  CHECK(deliveries.lastUserData == (void*)1);
+  CHECK(republished == UBSUB_ERR_QUEUE_FULL);
+  CHECK(client.getQueueSize() == 1);
+}
@@ -0,0 +1,99 @@
+#include "catch.hpp"
+#include "../src/workerpool.h"
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+  int worker;
+  int seq;
+} Job;
+
+typedef struct {
+  int last[4]; // Last seq run per worker
+  int outOfOrder;
+  int ran;
+  int sleepMicros;
+} JobLog;
+
+static void runJob(void* slot, void* userData) {
+  const Job* job = (const Job*)slot;
+  JobLog* log = (JobLog*)userData;
+  if (log->sleepMicros > 0)
+    usleep(log->sleepMicros);
+  // Only this worker touches its own entry
+  if (job->seq != log->last[job->worker] + 1)
+    __atomic_add_fetch(&log->outOfOrder, 1, __ATOMIC_RELAXED);
+  log->last[job->worker] = job->seq;
+  __atomic_add_fetch(&log->ran, 1, __ATOMIC_RELAXED);
+}
+
+TEST_CASE("Workers not started", "[WorkerPool]") {
+  WorkerPool pool;
+  CHECK_FALSE(pool.isRunning());
+  CHECK(pool.size() == 0);
+  CHECK_FALSE(pool.start(0, 8, sizeof(Job), runJob, NULL));
+  CHECK_FALSE(pool.start(2, 8, sizeof(Job), NULL, NULL));
+  pool.stop(); // Harmless
+}
+
+TEST_CASE("Workers run in order", "[WorkerPool]") {
+  JobLog log;
+  memset(&log, 0, sizeof(log));
+
+  WorkerPool pool;
+  REQUIRE(pool.start(4, 64, sizeof(Job), runJob, &log));
+  CHECK(pool.isRunning());
+  CHECK(pool.size() == 4);
+
+  int seq[4] = {0};
+  int submitted = 0;
+  while (submitted < 10000) {
+    const int worker = submitted % 4;
+    Job* job = (Job*)pool.reserve(worker);
+    if (job == NULL) {
+      usleep(10);
+      continue;
+    }
+    job->worker = worker;
+    job->seq = ++seq[worker];
+    pool.commit(worker);
+    submitted++;
+  }
+
+  // Stop runs everything still queued
+  pool.stop();
+  CHECK_FALSE(pool.isRunning());
+  CHECK(log.ran == 10000);
+  CHECK(log.outOfOrder == 0);
+  for (int i=0; i<4; ++i)
+    CHECK(log.last[i] == 2500);
+}
+
+TEST_CASE("Workers full", "[WorkerPool]") {
+  JobLog log;
+  memset(&log, 0, sizeof(log));
+  log.sleepMicros = 20000;
+
+  WorkerPool pool;
+  REQUIRE(pool.start(1, 3, sizeof(Job), runJob, &log)); // Rounded up to 4
+  CHECK(pool.available(0) == 4);
+
+  int committed = 0;
+  for (int i=0; i<20; ++i) {
+    Job* job = (Job*)pool.reserve(0);
+    if (job == NULL)
+      break;
+    job->worker = 0;
+    job->seq = ++committed;
+    pool.commit(0);
+  }
+
+  // The worker can have taken at most one job off while the first one sleeps
+  CHECK(committed >= 4);
+  CHECK(committed <= 5);
+  CHECK(pool.reserve(0) == NULL);
+
+  pool.stop();
+  CHECK(log.ran == committed);
+  CHECK(log.outOfOrder == 0);
+}